@@ -33,7 +33,7 @@ void setup_pair_data (SEXP pairs, const int nlibs, std::deque<const int*>& aptrs
     return;
 }
 
-binner::binner(SEXP all, SEXP bin, int f, int l) : fbin(f), lbin(l), nbins(l-f+1), ischanged(nbins, false) {
+binner::binner(SEXP all, SEXP bin, int f, int l) : fbin(f), lbin(l), nbins(l-f+1) {
 	if (!isInteger(bin)) { throw std::runtime_error("anchor bin indices must be integer vectors"); }
 	bptr=INTEGER(bin)-1; // Assuming 1-based indices for anchors and targets.
     if (nbins <= 0) { throw std::runtime_error("number of bins must be positive"); }
@@ -46,67 +46,85 @@ binner::binner(SEXP all, SEXP bin, int f, int l) : fbin(f), lbin(l), nbins(l-f+1
         // Populating the priority queue.
         if (nums[i]) { next.push(coord(bptr[aptrs[i][0]], bptr[tptrs[i][0]], i)); }
     }
-
-    curcounts.resize(nbins*nlibs);
 	return;
 }
 
 binner::~binner () {}
 
-void binner::fill() { 
-    /* Resetting 'ischanged' (which indicates whether we need to set all counts to zero) and 
-     * 'waschanged' (which provides a fast way to get to true values of 'ischanged').
-     */
-    for (std::deque<int>::const_iterator wcIt=waschanged.begin(); wcIt!=waschanged.end(); ++wcIt) {
-        ischanged[*wcIt]=false;
-    }
-    waschanged.clear();
+/* Rows with fewer than 'nbins/sparse_ratio' read pairs are considered to be sparse, 
+ * and are processed by sorting and reducing the read pairs in the row. Otherwise, counts
+ * are scattered into a dense array (only allocated when required) and gathered afterwards.
+ */
+
+const size_t binner::sparse_ratio=8;
 
+void binner::fill() { 
 	/* Running through all libraries. The idea is to use stretches of identical bin anchors, such that
 	 * we only need to worry about different bin targets (i.e., the problem becomes 1-dimensional).
 	 * This assumes that the bin transformation is monotonic, and that anchors are sorted. The function 
-	 * will stop once all identical bin anchors have been processed. Counts for all bins 
-	 * in this stretch are stored in passing through curcounts. 
+	 * will stop once all identical bin anchors have been processed. Each read pair in this stretch is
+	 * stored in 'buffer' as a combined index of the target bin and library.
 	 */
 	curab=next.top().anchor;
-	failed=false;
-
+	buffer.clear();
 	do {
-		curtb=next.top().target;
+		const coord& top=next.top();
+		curtb=top.target;
 		if (curtb > lbin || curtb < fbin) { throw std::runtime_error("target bin index is out the specified range");}
-		curdex=curtb-fbin;
-
-		// Checking whether we need to set up a new row, or whether it's already in use.
-		if (!ischanged[curdex]) {
-			waschanged.push_back(curdex);
-			ischanged[curdex]=true;
-			curdex*=nlibs;
-            std::fill(curcounts.begin()+curdex, curcounts.begin()+curdex+nlibs, 0);
-		} else {
-			curdex*=nlibs;
-		}
-
-		// Inner loop, to avoid multiple searches when the next batch of rows are in the same bin pair.
-		do {
-			curlib=next.top().library;
-			int& libdex=indices[curlib];
-			++(curcounts[curdex+curlib]);
-			next.pop();
-		 	if ((++libdex) < nums[curlib]) {
-				next.push(coord(bptr[aptrs[curlib][libdex]], bptr[tptrs[curlib][libdex]], curlib));
-			} else if (next.empty()) { 
-				failed=true;
-				break; 
+		curlib=top.library;
+		buffer.push_back((curtb-fbin)*nlibs+curlib);
+
+		int& libdex=indices[curlib];
+		next.pop();
+	 	if ((++libdex) < nums[curlib]) {
+			next.push(coord(bptr[aptrs[curlib][libdex]], bptr[tptrs[curlib][libdex]], curlib));
+		} 
+	} while (!next.empty() && next.top().anchor==curab);
+
+	/* Collating counts for each target bin with non-zero counts in any library. Targets are 
+	 * stored in ascending order in 'waschanged', and counts for the k-th target are stored in 
+	 * 'curcounts' from 'k*nlibs' to '(k+1)*nlibs'.
+	 */
+	waschanged.clear();
+	curcounts.clear();
+	if (buffer.size()*sparse_ratio < size_t(nbins)) {
+		std::sort(buffer.begin(), buffer.end());
+		int lastdex=-1;
+		for (size_t b=0; b<buffer.size(); ++b) {
+			const int curdex=buffer[b]/nlibs;
+			if (curdex!=lastdex) {
+				waschanged.push_back(curdex);
+				curcounts.resize(curcounts.size()+nlibs);
+				lastdex=curdex;
 			}
-			if ( curab != next.top().anchor ) {
-				failed=true;
-				break;
+			++(curcounts[curcounts.size()-nlibs+buffer[b]%nlibs]);
+		}
+	} else {
+		if (dense.empty()) {
+			dense.resize(nbins*nlibs);
+			ischanged.resize(nbins);
+		}
+		for (size_t b=0; b<buffer.size(); ++b) {
+			const int curdex=buffer[b]/nlibs;
+			if (!ischanged[curdex]) { 
+				ischanged[curdex]=true;
+				waschanged.push_back(curdex);
 			}
-		} while ( curtb == next.top().target );
-	} while (!failed);
+			++(dense[buffer[b]]);
+		}
 
-	// Sorting so all targets are in ascending order during addition (anchor sorting is implicit).
-	std::sort(waschanged.begin(), waschanged.end());
+		// Sorting so all targets are in ascending order during addition (anchor sorting is implicit).
+		std::sort(waschanged.begin(), waschanged.end());
+		curcounts.resize(waschanged.size()*nlibs);
+		std::vector<int>::iterator ccIt=curcounts.begin();
+		for (std::vector<int>::const_iterator wcIt=waschanged.begin(); wcIt!=waschanged.end(); ++wcIt) {
+			std::vector<int>::iterator dIt=dense.begin()+(*wcIt)*nlibs;
+			std::copy(dIt, dIt+nlibs, ccIt);
+			std::fill(dIt, dIt+nlibs, 0);
+			ischanged[*wcIt]=false;
+			ccIt+=nlibs;
+		}
+	}
 	return;
 }
 
@@ -118,6 +136,6 @@ int binner::get_nbins() const { return nbins; }
 
 int binner::get_anchor() const { return curab; }
 
-const std::deque<int>& binner::get_counts() const { return curcounts; }
+const std::vector<int>& binner::get_counts() const { return curcounts; }
 
-const std::deque<int>& binner::get_changed()  const { return waschanged; }
+const std::vector<int>& binner::get_changed()  const { return waschanged; }
@@ -0,0 +1,180 @@
+#include "diffhic.h"
+
+/* This identifies changepoints in the signal for a stretch of bins, using optimal segmentation
+ * with a Gaussian cost (i.e., the residual sum of squares from each segment mean) and a penalty
+ * 'beta' for each new segment. Candidates are pruned as described by Killick et al. (2012);
+ * with a minimum segment length of 'minsize', a candidate that is beaten at position 't' is only
+ * removed at 't+minsize', as the path through 't' is not allowed for shorter final segments.
+ * Segment start positions are returned (excluding zero).
+ */
+
+struct prefix_sums {
+	prefix_sums(const double* ptr, const int n) : sum(n+1), sumsq(n+1) {
+		for (int i=0; i<n; ++i) {
+			sum[i+1]=sum[i]+ptr[i];
+			sumsq[i+1]=sumsq[i]+ptr[i]*ptr[i];
+		}
+	}
+	double cost (const int s, const int e) const {
+		const double total=sum[e]-sum[s];
+		return sumsq[e]-sumsq[s]-total*total/(e-s);
+	}
+	double mean (const int s, const int e) const {
+		return (sum[e]-sum[s])/(e-s);
+	}
+	std::vector<double> sum, sumsq;
+};
+
+std::deque<int> optimal_segmentation(const prefix_sums& sums, const int offset, const int n, const double beta, const int minsize) {
+	std::deque<int> changes;
+	if (n < 2*minsize) { return changes; }
+	std::vector<double> best(n+1, R_PosInf);
+	std::vector<int> last(n+1, -1), prune_at(n+1, -1);
+	best[0]=-beta;
+
+	std::deque<int> candidates;
+	for (int t=minsize; t<=n; ++t) {
+		const int newcand=t-minsize;
+		if (best[newcand]!=R_PosInf) { candidates.push_back(newcand); }
+
+		double& curbest=best[t];
+		for (std::deque<int>::const_iterator cIt=candidates.begin(); cIt!=candidates.end(); ++cIt) {
+			const double curcost=best[*cIt] + sums.cost(offset + *cIt, offset + t) + beta;
+			if (curcost < curbest) {
+				curbest=curcost;
+				last[t]=*cIt;
+			}
+		}
+
+		// Marking candidates that cannot be optimal for any segment ending at or after 't+minsize'.
+		std::deque<int> retained;
+		for (std::deque<int>::const_iterator cIt=candidates.begin(); cIt!=candidates.end(); ++cIt) {
+			int& curprune=prune_at[*cIt];
+			if (curprune < 0 && best[*cIt] + sums.cost(offset + *cIt, offset + t) > curbest) { curprune=t+minsize; }
+			if (curprune < 0 || curprune > t+1) { retained.push_back(*cIt); }
+		}
+		candidates.swap(retained);
+	}
+
+	for (int t=last[n]; t>0; t=last[t]) { changes.push_front(t); }
+	return changes;
+}
+
+/* This calls domains on a chromosome from the directionality index, where a domain boundary
+ * is defined at a changepoint where the mean of the preceding segment is negative (i.e., biased
+ * towards downstream contacts at the end of a domain) and the mean of the following segment is
+ * positive (biased towards upstream contacts at the start of the next domain). Segmentation is
+ * repeated with each penalty in 'penalties', within the domains from the previous penalty, such
+ * that boundaries are nested across levels.
+ */
+
+void segment_chromosome(const prefix_sums& sums, const int chrstart, const int chrend, const double* penalties, const int nlevels, 
+		const int minsize, std::deque<int>& bounds, std::deque<int>& levels) {
+	std::set<int> current;
+	current.insert(chrstart);
+	current.insert(chrend);
+
+	for (int l=0; l<nlevels; ++l) {
+		std::deque<int> added;
+		std::set<int>::const_iterator cIt=current.begin(), nIt=cIt;
+		for (++nIt; nIt!=current.end(); ++cIt, ++nIt) {
+			const int& start=*cIt;
+			const int n=*nIt - start;
+			const std::deque<int> changes=optimal_segmentation(sums, start, n, penalties[l], minsize);
+
+			// Only keeping changepoints where the segment means go from negative to positive.
+			int prev=0;
+			for (size_t i=0; i<changes.size(); ++i) {
+				const int& cur=changes[i];
+				const int next=(i+1 < changes.size() ? changes[i+1] : n);
+				if (sums.mean(start + prev, start + cur) < 0 && sums.mean(start + cur, start + next) > 0) { added.push_back(start + cur); }
+				prev=cur;
+			}
+		}
+
+		for (size_t i=0; i<added.size(); ++i) {
+			current.insert(added[i]);
+			bounds.push_back(added[i]);
+			levels.push_back(l);
+		}
+	}
+	return;
+}
+
+/* Domains are called on each chromosome in parallel, see above for details.
+ */
+
+extern "C" {
+
+SEXP call_domains(SEXP signal, SEXP chrends, SEXP penalties, SEXP minsize, SEXP nthreads) try {
+	if (!isReal(signal)) { throw std::runtime_error("signal must be a double-precision vector"); }
+	const int nbins=LENGTH(signal);
+	const double* sptr=REAL(signal);
+	for (int b=0; b<nbins; ++b) {
+		if (!R_FINITE(sptr[b])) { throw std::runtime_error("signal must contain finite values"); }
+	}
+	if (!isInteger(chrends)) { throw std::runtime_error("chromosome end indices must be integer"); }
+	const int nchrs=LENGTH(chrends);
+	const int* cptr=INTEGER(chrends);
+	std::vector<int> chrstarts(nchrs+1);
+	for (int c=0; c<nchrs; ++c) {
+		if (cptr[c] < chrstarts[c] || cptr[c] > nbins) { throw std::runtime_error("invalid chromosome end indices"); }
+		chrstarts[c+1]=cptr[c];
+	}
+	if (chrstarts[nchrs]!=nbins) { throw std::runtime_error("chromosome end indices must span all bins"); }
+
+	if (!isReal(penalties)) { throw std::runtime_error("penalties must be a double-precision vector"); }
+	const int nlevels=LENGTH(penalties);
+	const double* pptr=REAL(penalties);
+	for (int l=0; l<nlevels; ++l) {
+		if (!R_FINITE(pptr[l]) || pptr[l] < 0) { throw std::runtime_error("penalties must be non-negative"); }
+	}
+	if (!isInteger(minsize) || LENGTH(minsize)!=1 || asInteger(minsize) < 1) { throw std::runtime_error("minimum size should be a positive integer scalar"); }
+	const int ms=asInteger(minsize);
+	if (!isInteger(nthreads) || LENGTH(nthreads)!=1 || asInteger(nthreads) < 1) {
+		throw std::runtime_error("number of threads should be a positive integer scalar"); }
+	const int nt=asInteger(nthreads);
+
+	const prefix_sums sums(sptr, nbins);
+	std::vector<std::deque<int> > bounds(nchrs), levels(nchrs);
+
+	// Exceptions cannot leave the parallel region, so we save the message instead.
+	std::string failure;
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+	for (int c=0; c<nchrs; ++c) {
+		try {
+			segment_chromosome(sums, chrstarts[c], chrstarts[c+1], pptr, nlevels, ms, bounds[c], levels[c]);
+		} catch (std::exception& e) {
+#pragma omp critical
+			failure=e.what();
+		}
+	}
+	if (!failure.empty()) { throw std::runtime_error(failure); }
+
+	int ntotal=0;
+	for (int c=0; c<nchrs; ++c) { ntotal+=bounds[c].size(); }
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+try {
+	SET_VECTOR_ELT(output, 0, allocVector(INTSXP, ntotal));
+	int* bptr=INTEGER(VECTOR_ELT(output, 0));
+	SET_VECTOR_ELT(output, 1, allocVector(INTSXP, ntotal));
+	int* lptr=INTEGER(VECTOR_ELT(output, 1));
+	for (int c=0; c<nchrs; ++c) {
+		for (size_t i=0; i<bounds[c].size(); ++i) {
+			*bptr=bounds[c][i]+1;
+			*lptr=levels[c][i]+1;
+			++bptr;
+			++lptr;
+		}
+	}
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+}
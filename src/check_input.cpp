@@ -1,65 +1,250 @@
-#include "diffhic.h"
+#include "interval_tree.h"
 
-/* This just provides a function that quickly and efficiently
- * checks the incoming pair counts for (a) anchor >= target,
- * (b) ordering of anchor and targets.
+/* This provides a class to check whether a read lies within any of the
+ * discard intervals on a chromosome. Intervals are assumed to be sorted
+ * and non-overlapping (i.e., after 'reduce'), so the only candidate is the
+ * last interval starting at or before the start of the read.
  */
 
-SEXP check_input (SEXP anchor, SEXP target) try { 
-	if (!isInteger(anchor)) { throw std::runtime_error("anchor should be an integer vector"); }
-	if (!isInteger(target)) { throw std::runtime_error("target should be an integer vector"); }
-	const int nlen=LENGTH(anchor);
-	if (LENGTH(target)!=nlen) { throw std::runtime_error("vectors should be of the same length"); }
-
-	const int * aptr=INTEGER(anchor),
-		  * tptr=INTEGER(target);
-
-	if (nlen) {
-		if (aptr[0] < tptr[0]) { throw std::runtime_error("anchor should be greater than or equal to target"); }
-		for (int i=1; i<nlen; ++i) {
-			if (aptr[i] < tptr[i]) { throw std::runtime_error("anchor should be greater than or equal to target"); }
-			if (aptr[i] < aptr[i-1] || (aptr[i]==aptr[i-1] && tptr[i] < tptr[i-1])) {
-				throw std::runtime_error("pairs should be sorted by anchor and target"); 
-			}
+class discard_set {
+public:
+	discard_set(SEXP bounds) : nranges(0), sptr(NULL), eptr(NULL) {
+		if (!isNewList(bounds) || LENGTH(bounds)!=2) { throw std::runtime_error("discard bounds should be a list of length 2"); }
+		SEXP starts=VECTOR_ELT(bounds, 0), ends=VECTOR_ELT(bounds, 1);
+		if (!isInteger(starts) || !isInteger(ends)) { throw std::runtime_error("discard bounds should be integer vectors"); }
+		nranges=LENGTH(starts);
+		if (nranges!=LENGTH(ends)) { throw std::runtime_error("discard start and end vectors should be of the same length"); }
+		sptr=INTEGER(starts);
+		eptr=INTEGER(ends);
+	}
+	bool empty() const { return nranges==0; }
+	bool contains(int pos, int len) const {
+		const int* it=std::upper_bound(sptr, sptr+nranges, pos);
+		if (it==sptr) { return false; }
+		const int last=pos + std::abs(len) - 1;
+		return (eptr[(it - sptr) - 1] >= last);
+	}
+private:
+	int nranges;
+	const int* sptr, * eptr;
+};
+
+/* This provides a class to check whether a read pair lies within the restricted regions.
+ * For paired regions, each region pair defines a rectangle in the interaction space, and
+ * the rectangles covering the anchor1 value are identified with an interval tree before
+ * checking the anchor2 value. These are cached, as pairs with the same anchor1 value are 
+ * consecutive when sorted. For unpaired regions, the anchor1 and anchor2 values only need 
+ * to lie within any of the regions on the corresponding chromosome.
+ */
+
+class region_set {
+public:
+	region_set(SEXP bounds) : active(!isNull(bounds)), paired(false), curval(NA_INTEGER) {
+		if (!active) { return; }
+		if (!isNewList(bounds) || LENGTH(bounds)!=5) { throw std::runtime_error("region bounds should be a list of length 5"); }
+		int nbounds[4];
+		for (int i=0; i<4; ++i) {
+			SEXP current=VECTOR_ELT(bounds, i);
+			if (!isInteger(current)) { throw std::runtime_error("region bounds should be integer vectors"); }
+			nbounds[i]=LENGTH(current);
+			ptrs[i]=INTEGER(current);
+		}
+		SEXP pairing=VECTOR_ELT(bounds, 4);
+		if (!isLogical(pairing) || LENGTH(pairing)!=1) { throw std::runtime_error("region pairing should be a logical scalar"); }
+		paired=asLogical(pairing);
+		if (nbounds[0]!=nbounds[1] || nbounds[2]!=nbounds[3] || (paired && nbounds[0]!=nbounds[2])) { 
+			throw std::runtime_error("region bound vectors should be of the same length"); 
+		}
+
+		std::vector<int> indices(nbounds[0]);
+		for (int r=0; r<nbounds[0]; ++r) { indices[r]=r; }
+		first=interval_tree(indices, ptrs[0], ptrs[1]);
+		if (!paired) {
+			indices.resize(nbounds[2]);
+			for (int r=0; r<nbounds[2]; ++r) { indices[r]=r; }
+			second=interval_tree(indices, ptrs[2], ptrs[3]);
 		}
 	}
-	return ScalarLogical(1);
-} catch (std::exception& e){
-	return mkString(e.what());
+	bool is_active() const { return active; }
+
+	bool contains(int anchor, int target) {
+		if (!paired) { return first.any(anchor, anchor) && second.any(target, target); }
+		if (anchor!=curval) {
+			curval=anchor;
+			first.query(anchor, anchor, covering);
+		}
+		for (size_t c=0; c<covering.size(); ++c) {
+			const int& r=covering[c];
+			if (ptrs[2][r] <= target && target <= ptrs[3][r]) { return true; }
+		}
+		return false;
+	}
+private:
+	bool active, paired;
+	int curval;
+	const int* ptrs[4];
+	interval_tree first, second;
+	std::vector<int> covering;
+};
+
+int five_prime(int pos, int len) {
+	return (len < 0 ? pos - len - 1 : pos);
+}
+
+/* This converts the 5' end of each read into a bin ID, for DNase-C data.
+ * Reverse reads with start positions beyond the last bin are left alone,
+ * so that they are caught by the range checks later on.
+ */
+
+int read_to_bin(int pos, int len, int width, int first, int last) {
+	int id=int(std::ceil(double(pos)/width)) - 1 + first;
+	if (len < 0 && id <= last) {
+		const int rev5=pos - len - 1;
+		id=std::min(last, int(std::ceil(double(rev5)/width)) - 1 + first);
+	}
+	return id;
 }
 
-/* This provides a function that attempts to cap the 
- * number of read pairs generated from each restriction fragment.
- * It assumes that all anchor and target indices are already
- * sorted, based on passing check_input.
+struct sort_pair_index {
+	sort_pair_index(const int* a, const int* t) : aptr(a), tptr(t) {}
+	bool operator() (const int& l, const int& r) const {
+		if (aptr[l]==aptr[r]) { return (tptr[l] < tptr[r]); }
+		return (aptr[l] < aptr[r]);
+	}
+private:
+	const int* aptr, * tptr;
+};
+
+/* This streams through the read pairs for a single chromosome pair, and does
+ * everything required before counting: (a) binning reads for DNase-C data,
+ * (b) checking that anchor1 >= anchor2 and that pairs are sorted, (c) checking
+ * that IDs are within the chromosome ranges, (d) removing read pairs in the
+ * discard intervals and (e) capping the number of read pairs per fragment pair.
+ * If regions are specified, only read pairs within the corresponding rectangles 
+ * are retained. These are defined in terms of IDs or, for DNase-C data, in terms
+ * of the 5' end of each read. All pairs are still subject to the checks in (b)
+ * and (c), even if they lie outside of the regions.
+ * It returns the (1-based) indices of the retained read pairs, whether they
+ * were swapped during binning, and their anchor IDs.
  */
 
-SEXP cap_input (SEXP anchor, SEXP target, SEXP cap) try { 
-	if (!isInteger(anchor)) { throw std::runtime_error("anchor should be an integer vector"); }
-	if (!isInteger(target)) { throw std::runtime_error("target should be an integer vector"); }
-	const int nlen=LENGTH(anchor);
-	if (LENGTH(target)!=nlen) { throw std::runtime_error("vectors should be of the same length"); }
+SEXP process_pairs (SEXP anchor1_id, SEXP anchor2_id, SEXP anchor1_pos, SEXP anchor2_pos, SEXP anchor1_len, SEXP anchor2_len,
+		SEXP limits, SEXP discard1, SEXP discard2, SEXP cap, SEXP width, SEXP regions, SEXP positional) try {
+	if (!isInteger(anchor1_id) || !isInteger(anchor2_id)) { throw std::runtime_error("anchor IDs should be integer vectors"); }
+	if (!isInteger(anchor1_pos) || !isInteger(anchor2_pos)) { throw std::runtime_error("anchor positions should be integer vectors"); }
+	if (!isInteger(anchor1_len) || !isInteger(anchor2_len)) { throw std::runtime_error("anchor lengths should be integer vectors"); }
+	const int nlen=LENGTH(anchor1_id);
+	if (LENGTH(anchor2_id)!=nlen || LENGTH(anchor1_pos)!=nlen || LENGTH(anchor2_pos)!=nlen
+			|| LENGTH(anchor1_len)!=nlen || LENGTH(anchor2_len)!=nlen) {
+		throw std::runtime_error("vectors should be of the same length");
+	}
+
+	if (!isInteger(limits) || LENGTH(limits)!=4) { throw std::runtime_error("limits should be an integer vector of length 4"); }
+	const int* lptr=INTEGER(limits);
+	const int first1=lptr[0], last1=lptr[1], first2=lptr[2], last2=lptr[3];
+	const discard_set disc1(discard1), disc2(discard2);
+	const bool do_disc=(!disc1.empty() || !disc2.empty());
 
-	const int * aptr=INTEGER(anchor),
-		  * tptr=INTEGER(target);
 	if (!isInteger(cap) || LENGTH(cap)!=1) { throw std::runtime_error("cap should be an integer scalar"); }
 	const int recap=asInteger(cap);
+	const bool do_cap=(recap!=NA_INTEGER);
+	if (!isInteger(width) || LENGTH(width)!=1) { throw std::runtime_error("width should be an integer scalar"); }
+	const int binwidth=asInteger(width);
+	const bool do_bin=(binwidth!=NA_INTEGER);
+	if (do_bin && binwidth <= 0) { throw std::runtime_error("width should be a positive integer"); }
+	region_set restricted(regions);
+	if (!isLogical(positional) || LENGTH(positional)!=1) { throw std::runtime_error("positional specifier should be a logical scalar"); }
+	const bool use_pos=asLogical(positional);
 
-	SEXP output=PROTECT(allocVector(LGLSXP, nlen));
-try {
-	if (nlen) { 
-		int * optr=LOGICAL(output);
-		optr[0]=1;
-		int counter=1;
-		for (int i=1; i<nlen; ++i) {
-			if (aptr[i]==aptr[i-1] && tptr[i]==tptr[i-1]) {
+	const int * a1ptr=INTEGER(anchor1_id), * a2ptr=INTEGER(anchor2_id),
+		  * p1ptr=INTEGER(anchor1_pos), * p2ptr=INTEGER(anchor2_pos),
+		  * l1ptr=INTEGER(anchor1_len), * l2ptr=INTEGER(anchor2_len);
+
+	// Binning the reads and enforcing anchor1 >= anchor2 for DNase-C data, and then sorting.
+	std::vector<int> binned1, binned2, ordering(nlen);
+	std::vector<bool> swapped;
+	for (int i=0; i<nlen; ++i) { ordering[i]=i; }
+	if (do_bin) {
+		binned1.resize(nlen);
+		binned2.resize(nlen);
+		swapped.resize(nlen);
+		for (int i=0; i<nlen; ++i) {
+			int& b1=binned1[i];
+			int& b2=binned2[i];
+			b1=read_to_bin(p1ptr[i], l1ptr[i], binwidth, first1, last1);
+			b2=read_to_bin(p2ptr[i], l2ptr[i], binwidth, first2, last2);
+			if (b2 > b1) {
+				std::swap(b1, b2);
+				swapped[i]=true;
+			}
+		}
+		a1ptr=binned1.data();
+		a2ptr=binned2.data();
+		std::stable_sort(ordering.begin(), ordering.end(), sort_pair_index(a1ptr, a2ptr));
+	}
+
+	// Running through the pairs in a single pass.
+	std::deque<int> kept;
+	int preva=-1, prevt=-1, kepta=-1, keptt=-1, counter=0;
+	for (int k=0; k<nlen; ++k) {
+		const int& i=ordering[k];
+		const int& curi=a1ptr[i];
+		const int& curt=a2ptr[i];
+		if (curi < curt) { throw std::runtime_error("anchor should be greater than or equal to target"); }
+		if (k && (curi < preva || (curi==preva && curt < prevt))) { throw std::runtime_error("pairs should be sorted by anchor and target"); }
+		preva=curi;
+		prevt=curt;
+
+		if (curi > last1 || curi < first1) { throw std::runtime_error("anchor1 index outside range of fragment object"); }
+		if (curt > last2 || curt < first2) { throw std::runtime_error("anchor2 index outside range of fragment object"); }
+
+		const bool swap=(do_bin && swapped[i]);
+		if (restricted.is_active()) {
+			const bool inside=(use_pos ? 
+				restricted.contains(swap ? five_prime(p2ptr[i], l2ptr[i]) : five_prime(p1ptr[i], l1ptr[i]), 
+					swap ? five_prime(p1ptr[i], l1ptr[i]) : five_prime(p2ptr[i], l2ptr[i])) :
+				restricted.contains(curi, curt));
+			if (!inside) { continue; }
+		}
+
+		if (do_disc) {
+			if (disc1.contains(swap ? p2ptr[i] : p1ptr[i], swap ? l2ptr[i] : l1ptr[i]) ||
+					disc2.contains(swap ? p1ptr[i] : p2ptr[i], swap ? l1ptr[i] : l2ptr[i])) {
+				continue;
+			}
+		}
+
+		if (do_cap) {
+			if (kept.size() && curi==kepta && curt==keptt) {
 				++counter;
-				optr[i]=(counter <= recap);
 			} else {
 				counter=1;
-				optr[i]=1;
+				kepta=curi;
+				keptt=curt;
 			}
+			if (counter > recap) { continue; }
 		}
+		kept.push_back(i);
+	}
+
+	const int nkept=kept.size();
+	SEXP output=PROTECT(allocVector(VECSXP, 4));
+try {
+	SET_VECTOR_ELT(output, 0, allocVector(INTSXP, nkept));
+	int* optr=INTEGER(VECTOR_ELT(output, 0));
+	SET_VECTOR_ELT(output, 1, allocVector(LGLSXP, nkept));
+	int* sptr=LOGICAL(VECTOR_ELT(output, 1));
+	SET_VECTOR_ELT(output, 2, allocVector(INTSXP, nkept));
+	int* o1ptr=INTEGER(VECTOR_ELT(output, 2));
+	SET_VECTOR_ELT(output, 3, allocVector(INTSXP, nkept));
+	int* o2ptr=INTEGER(VECTOR_ELT(output, 3));
+
+	for (int k=0; k<nkept; ++k) {
+		const int& i=kept[k];
+		optr[k]=i+1;
+		sptr[k]=(do_bin && swapped[i]);
+		o1ptr[k]=a1ptr[i];
+		o2ptr[k]=a2ptr[i];
 	}
 } catch (std::exception& e) {
 	UNPROTECT(1);
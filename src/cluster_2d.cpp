@@ -1,4 +1,4 @@
-#include "diffhic.h"
+#include "clusters.h"
 //#define DEBUG 1
 
 #ifdef DEBUG
@@ -18,37 +18,160 @@
 
 const int nothing=-1;
 
-SEXP cluster_2d (SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t, SEXP tol, SEXP verbose) try {
-	if (!isInteger(start_a) || !isInteger(start_t) || !isInteger(end_a) || !isInteger(end_t)) {
-		throw std::runtime_error("anchor or target start and ends must be integer"); }
-	const int npts=LENGTH(start_a);
-	if (npts!=LENGTH(start_t) || npts!=LENGTH(end_a) || npts!=LENGTH(end_t)) { 
-		throw std::runtime_error("lengths of coordinate vectors are not equal"); }
-	if (!isInteger(tol) || LENGTH(tol)!=1) { 
-		throw std::runtime_error("tolerance should be an integer scalar"); }
-	if (!isLogical(verbose) || LENGTH(verbose)!=1) { 
-		throw std::runtime_error("verbosity should be a logical scalar"); }
+/* The landscape is stored as a sequence of small sorted blocks of posts, where each 
+ * post specifies the highest anchor end (and the ID of the corresponding box) from its 
+ * target position to the next post. This is more cache-friendly than a node-based map, 
+ * while still allowing cheap insertions and deletions for large landscapes. Insertion 
+ * has the same semantics as std::map::insert, i.e., nothing is done if a post already 
+ * exists at the specified position. Cursors are invalidated by insertions or deletions, 
+ * except for those pointing to earlier posts than the deleted post.
+ */
+
+struct post {
+	post(int p, int h, int i) : position(p), height(h), id(i) {}
+	int position, height, id;
+};
+
+struct compare_post {
+	bool operator() (const post& p, int pos) const { return p.position < pos; }
+};
+
+class landscape_blocks {
+public:
+	struct cursor {
+		cursor(size_t b, size_t o) : block(b), offset(o) {}
+		size_t block, offset;
+	};
+
+	cursor lower_bound(int pos) const {
+		size_t left=0, right=blocks.size();
+		while (left < right) { // Finding the first block with a last position not less than 'pos'.
+			const size_t mid=left + (right-left)/2;
+			if (blocks[mid].back().position < pos) { left=mid+1; }
+			else { right=mid; }
+		}
+		if (left==blocks.size()) { return end(); }
+		const std::vector<post>& current=blocks[left];
+		return cursor(left, std::lower_bound(current.begin(), current.end(), pos, compare_post()) - current.begin());
+	}
 
-	const int width=asInteger(tol);
-	const int* asptr=INTEGER(start_a),
-		* aeptr=INTEGER(end_a),
-		* tsptr=INTEGER(start_t),
-		* teptr=INTEGER(end_t);
-	const int verb=asLogical(verbose);
-	
-	// Setting up the output construct, which specifies the cluster ID of each point.
-	SEXP output=PROTECT(allocVector(INTSXP, npts));
-try {
-	int* optr=INTEGER(output);
-	
+	cursor end() const { return cursor(blocks.size(), 0); }
+	bool at_end(const cursor& c) const { return c.block==blocks.size(); }
+	bool at_begin(const cursor& c) const { return c.block==0 && c.offset==0; }
+	post& get(const cursor& c) { return blocks[c.block][c.offset]; }
+
+	void next(cursor& c) const {
+		++c.offset;
+		if (c.offset==blocks[c.block].size()) {
+			++c.block;
+			c.offset=0;
+		}
+	}
+	void prev(cursor& c) const {
+		if (c.offset==0) {
+			--c.block;
+			c.offset=blocks[c.block].size();
+		}
+		--c.offset;
+	}
+
+	cursor insert(int pos, int height, int id) {
+		cursor c=lower_bound(pos);
+		if (!at_end(c)) {
+			if (get(c).position==pos) { return c; }
+		} else if (blocks.empty()) { 
+			blocks.push_back(std::vector<post>());
+			blocks.back().reserve(max_block);
+		} else { // Appending to the last block.
+			--c.block;
+			c.offset=blocks[c.block].size();
+		}
+
+		std::vector<post>& current=blocks[c.block];
+		current.insert(current.begin()+c.offset, post(pos, height, id));
+		if (current.size() >= max_block) { // Splitting the block in half.
+			const size_t half=current.size()/2;
+			blocks.insert(blocks.begin()+c.block+1, std::vector<post>());
+			std::vector<post>& previous=blocks[c.block], & following=blocks[c.block+1];
+			following.reserve(max_block);
+			following.assign(previous.begin()+half, previous.end());
+			previous.erase(previous.begin()+half, previous.end());
+			if (c.offset >= half) {
+				++c.block;
+				c.offset-=half;
+			}
+		}
+		return c;
+	}
+
+	cursor erase(cursor c) { // Returns a cursor to the next post.
+		std::vector<post>& current=blocks[c.block];
+		current.erase(current.begin()+c.offset);
+		if (current.empty()) {
+			blocks.erase(blocks.begin()+c.block);
+			c.offset=0;
+		} else if (c.offset==current.size()) {
+			++c.block;
+			c.offset=0;
+		}
+		return c;
+	}
+
+	template<class Function>
+	void apply(Function fun) const {
+		for (size_t b=0; b<blocks.size(); ++b) {
+			for (size_t o=0; o<blocks[b].size(); ++o) { fun(blocks[b][o]); }
+		}
+	}
+private:
+	static const size_t max_block=128;
+	std::vector<std::vector<post> > blocks;
+};
+
+/* Overlaps between boxes with different IDs are resolved with a union-find
+ * structure, using path compression and setting the smaller ID as the root.
+ */
+
+int find_root(std::vector<int>& parent, int x) {
+	int root=x;
+	while (parent[root]!=root) { root=parent[root]; }
+	while (parent[x]!=root) {
+		const int next=parent[x];
+		parent[x]=root;
+		x=next;
+	}
+	return root;
+}
+
+void unite(std::vector<int>& parent, std::vector<int>& size, int x, int y) {
+	x=find_root(parent, x);
+	y=find_root(parent, y);
+	if (x==y) { return; }
+	if (y < x) { std::swap(x, y); }
+	parent[y]=x;
+	size[x]+=size[y];
+	return;
+}
+
+void print_post(const post& p) {
+	Rprintf("%i[%i](%i) ", p.position, p.height, p.id);
+}
+
+#ifdef DEBUG
+void debug_post(const post& p) {
+	std::cout << p.position << ": " << p.height << " (" << p.id << ")" << std::endl;
+}
+#endif
+
+int cluster_sweep(int npts, const int* asptr, const int* tsptr, const int* aeptr, const int* teptr, int width, bool verb, int* optr) {
 	/* We assume all points are sorted by start_a, start_t already. The idea is to
  	 * raster over the interaction space, assimilating all those which lie within 'tol'
- 	 * of previous points. Overlaps with multiple points result in the formation of
- 	 * synonyms which will be resolved at the end of the function.
+ 	 * of previous points. Overlaps with multiple points result in the merging of
+ 	 * their IDs in the union-find structure.
  	 */
-	std::map<int, std::pair<int, int> > landscape;
-	std::map<int, std::pair<int, int> >::iterator itl, ito;
-	std::set<std::pair<int, int> > synonyms;
+	landscape_blocks landscape;
+	landscape_blocks::cursor il=landscape.end();
+	std::vector<int> parent, size;
 	int ptdex=0, numids=0;
 	bool beforestart;
 
@@ -67,57 +190,52 @@ try {
 		int& myid=(optr[ptdex]=nothing);
 
 		// Identifying the landscape element before or at the current target
-		itl=landscape.lower_bound(baset);
-		if (itl==landscape.end()) {
-			; 
-		} else {
-			if ((itl->first)!=baset && itl!=landscape.begin()) {
-				--itl;
-				if ((itl->second).first > basea) { myid=(itl->second).second; }
+		il=landscape.lower_bound(baset);
+		if (!landscape.at_end(il)) {
+			if (landscape.get(il).position!=baset && !landscape.at_begin(il)) {
+				landscape.prev(il);
+				if (landscape.get(il).height > basea) { myid=landscape.get(il).id; }
 			}
 			
 			// Running through everything in range, seeing if it overlaps anything else.
-			while (itl!=landscape.end() && itl->first < finisht) {
- 				if ((itl->second).first > basea) {
-					const int& alternative=(itl->second).second;
+			while (!landscape.at_end(il) && landscape.get(il).position < finisht) {
+				const post& current=landscape.get(il);
+ 				if (current.height > basea) {
+					const int& alternative=current.id;
 					if (alternative==nothing) { 
 						;
 					} else if (myid==nothing) {
 						myid=alternative;
 					} else if (myid!=alternative) {
-						if (alternative > myid) {
- 	 					   	synonyms.insert(std::make_pair(myid, alternative));
-						} else {
- 	 					   	synonyms.insert(std::make_pair(alternative, myid));
-						}
+						unite(parent, size, myid, alternative);
 					}
  				}
-				++itl;
+				landscape.next(il);
 			} 
 		}
 		if (myid==nothing) { // Incrementing to the next ID, if the current box doesn't overlap with anything.
 			myid=numids;
+			parent.push_back(numids);
+			size.push_back(1);
 			++numids;
 		}
 
 		// Adding the current endpoint of our box to the landscape.
-		if (itl==landscape.begin()) {
- 	 	   	itl=landscape.insert(itl, std::make_pair(endt, std::make_pair(nothing, nothing)));
+		if (landscape.at_begin(il)) {
+ 	 	   	il=landscape.insert(endt, nothing, nothing);
 		} else {
-			--itl; 
-			while (itl!=landscape.begin() && itl->first > endt) { --itl; } // Get to the first point in front of or equal to endt.
+			landscape.prev(il);
+			while (!landscape.at_begin(il) && landscape.get(il).position > endt) { landscape.prev(il); } // Get to the first point in front of or equal to endt.
 
 			/* We only need to change if it's different, remember; we want to keep the existing underlying element.
 			 * We also only add it if the landscape is less than the added point, otherwise we'd be underground or redundant.
 			 * Of course, the latter only applies if it's not a 'nothing' endpost.
 			 */
-			if (itl->first!=endt && ((itl->second).first < enda || (itl->second).second==nothing)) {
-				const int& lastid=(itl->second).second;
-				const int& lastheight=(itl->second).first;
-				++itl;
-				itl=landscape.insert(itl, std::make_pair(endt, std::make_pair(lastheight, lastid)));
-			} else if (itl->first!=endt) {
-				++itl; // Set to first element greater than endt, if nothing is equal to it. Ensures later `--itl' starts at the right point.
+			const post current=landscape.get(il);
+			if (current.position!=endt && (current.height < enda || current.id==nothing)) {
+				il=landscape.insert(endt, current.height, current.id);
+			} else if (current.position!=endt) {
+				landscape.next(il); // Set to first element greater than endt, if nothing is equal to it. Ensures later `prev' starts at the right point.
 			}
 		}
 
@@ -129,122 +247,111 @@ try {
 		 * then there's no way that later start anchors could overlap it either. So, the highest would be the best.
 		 * Finally, we add a new start post if the preceding element is not overriding us.
 		 */
-		beforestart=(itl==landscape.begin());
+		beforestart=landscape.at_begin(il);
 		if (!beforestart) { 
-			--itl;
-			while (itl->first > curt) {
-				if ((itl->second).second==nothing) {
-					// Peeking to see if the previous element has a high 'enda'.
-					--itl;
-					if ((itl->second).first <= enda) {
-						++itl;
-						landscape.erase(itl--);
+			landscape.prev(il);
+			while (landscape.get(il).position > curt) {
+				landscape_blocks::cursor previous=il;
+				if (landscape.get(il).id==nothing) {
+					// Peeking to see if the previous element has a high 'enda' (landscape can't start with nothing).
+					landscape.prev(previous);
+					if (landscape.get(previous).height <= enda) {
+						landscape.erase(il);
 					} else {
-						++itl;
-						(itl->second).first=enda;
-						(itl->second).second=myid;
-						--itl; // landscape can't start with nothing, so don't worry about begin().
+						post& current=landscape.get(il);
+						current.height=enda;
+						current.id=myid;
 					}
-				} else if ((itl->second).first <= enda) { 
-					if (itl!=landscape.begin()) { 
-						landscape.erase(itl--); 
-					} else {
-						landscape.erase(itl++);
+					il=previous;
+				} else if (landscape.get(il).height <= enda) { 
+					if (landscape.at_begin(il)) { 
+						landscape.erase(il);
 						beforestart=true;
 						break;
 					}
+					landscape.prev(previous);
+					landscape.erase(il);
+					il=previous;
 				} else {
-					if (itl==landscape.begin()) { 
+					if (landscape.at_begin(il)) { 
 						beforestart=true;
 						break; 
 					}
-					--itl;
+					landscape.prev(il);
 				}
  			}
 		}
 		if (beforestart) { // If the current target is before the landscape start, we must add it.
-			itl=landscape.insert(itl, std::make_pair(curt, std::make_pair(enda, myid)));
-		} else if ((itl->second).first < enda || (itl->second).second==nothing) { // Shouldn't be empty, after adding the endpoint, above. 
-			if (itl->first==curt) {
-				(itl->second).first=enda;
-				(itl->second).second=myid;
-			} else {
-				++itl;
-				itl=landscape.insert(itl, std::make_pair(curt, std::make_pair(enda, myid)));
+			landscape.insert(curt, enda, myid);
+		} else {
+			post& current=landscape.get(il);
+			if (current.height < enda || current.id==nothing) { // Shouldn't be empty, after adding the endpoint, above. 
+				if (current.position==curt) {
+					current.height=enda;
+					current.id=myid;
+				} else {
+					landscape.insert(curt, enda, myid);
+				}
 			}
 		}
 
 		if (verb) { // Printing landscape.
-			for (std::map<int, std::pair<int, int> >::const_iterator itx=landscape.begin(); itx!=landscape.end(); ++itx) {
-                Rprintf("%i[%i](%i) ", itx->first, (itx->second).first, (itx->second).second);
-			}
+			landscape.apply(print_post);
 			Rprintf("\n");
 		}
 
 #ifdef DEBUG
 		std::cout << "#### New landscape!" << std::endl;
-		for (std::map<int, std::pair<int, int> >::const_iterator itx=landscape.begin(); itx!=landscape.end(); ++itx) {
-			std::cout << itx->first << ": " << (itx->second).first << " (" << (itx->second).second << ")" << std::endl;
-		}
+		landscape.apply(debug_post);
 #endif		
 		++ptdex;
 	}
 
-	// Resolving synonyms using a recursive-ish algorithm. It's a bit slow but at least it'll work. I need to fill up the reverse, though.
-	{ 
-		std::set<std::pair<int, int> > alternate;
-		for (std::set<std::pair<int, int> >::iterator its=synonyms.begin(); its!=synonyms.end(); ++its) { 
-			alternate.insert(std::make_pair(its->second, its->first)); }
-		synonyms.insert(alternate.begin(), alternate.end());
-	}
-#ifdef DEBUG
-	std::cout << "Synonyms are: " << std::endl;
-	for (std::set<std::pair<int, int> >::const_iterator itx=synonyms.begin(); itx!=synonyms.end(); ++itx) {
-		std::cout << itx->first << "\t" << itx->second << std::endl;;
-	}
-	std::cout << "Iterating now!" << std::endl;
-#endif
-	
-	std::deque<int> newids(numids, nothing);
-	numids=1;
-	while (!synonyms.empty()) {
-		std::priority_queue<int, std::deque<int>, std::greater<int> > next;
-		std::set<std::pair<int, int> >::iterator itx=synonyms.begin();
-		int curid=itx->first;
-		newids[curid]=numids;
-
-		bool found=false;
-		do {
-			do {
-				next.push(itx->second);
-				newids[itx->second]=numids;
-				synonyms.erase(itx++);
-			} while (itx!=synonyms.end() && curid==itx->first);
-
-			found=false;
-			while (!next.empty()) {
-				curid=next.top();
-				itx=synonyms.lower_bound(std::make_pair(curid, nothing));
-				do { next.pop(); } while (!next.empty() && next.top()==curid);
-
-				if (itx!=synonyms.end() && itx->first==curid) {
-					found=true;
-					break;
-				}
-			}
-		} while (found);
-		++numids;
+	/* Renumbering the IDs. Clusters formed from multiple IDs are numbered first, in order 
+	 * of their smallest ID; clusters formed from a single ID are then numbered in order.
+	 */
+	std::vector<int> newids(numids, nothing);
+	int lastid=1;
+	for (int i=0; i<numids; ++i) {
+		if (parent[i]==i && size[i] > 1) { 
+			newids[i]=lastid;
+			++lastid;
+		}
 	}
-
-	// Mopping up anything which doesn't have any synonyms.
-	for (size_t i=0; i<newids.size(); ++i) {
-		if (newids[i]==nothing) { 
-			newids[i]=numids;
-			++numids;
+	for (int i=0; i<numids; ++i) {
+		if (parent[i]==i && size[i]==1) { 
+			newids[i]=lastid;
+			++lastid;
 		}
 	}
+	for (int i=0; i<numids; ++i) { newids[i]=newids[find_root(parent, i)]; }
 	
 	for (int i=0; i<npts; ++i) { optr[i]=newids[optr[i]]; }
+	return lastid-1;
+}
+
+SEXP cluster_2d (SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t, SEXP tol, SEXP verbose) try {
+	if (!isInteger(start_a) || !isInteger(start_t) || !isInteger(end_a) || !isInteger(end_t)) {
+		throw std::runtime_error("anchor or target start and ends must be integer"); }
+	const int npts=LENGTH(start_a);
+	if (npts!=LENGTH(start_t) || npts!=LENGTH(end_a) || npts!=LENGTH(end_t)) { 
+		throw std::runtime_error("lengths of coordinate vectors are not equal"); }
+	if (!isInteger(tol) || LENGTH(tol)!=1) { 
+		throw std::runtime_error("tolerance should be an integer scalar"); }
+	if (!isLogical(verbose) || LENGTH(verbose)!=1) { 
+		throw std::runtime_error("verbosity should be a logical scalar"); }
+
+	const int width=asInteger(tol);
+	const int* asptr=INTEGER(start_a),
+		* aeptr=INTEGER(end_a),
+		* tsptr=INTEGER(start_t),
+		* teptr=INTEGER(end_t);
+	const bool verb=asLogical(verbose);
+	
+	// Setting up the output construct, which specifies the cluster ID of each point.
+	SEXP output=PROTECT(allocVector(INTSXP, npts));
+try {
+	cluster_sweep(npts, asptr, tsptr, aeptr, teptr, width, verb, INTEGER(output));
 } catch (std::exception &e) {
 	UNPROTECT(1);
 	throw;
@@ -268,34 +375,14 @@ try {
  ****************************************************************************
  ****************************************************************************/
 
-SEXP split_clusters (SEXP id, SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t, SEXP maxw) try {
-	if (!isInteger(id)) { throw std::runtime_error("cluster id values should be integer"); }
-	const int npts=LENGTH(id);
-	if (!isInteger(start_a) || !isInteger(start_t) || !isInteger(end_a) || !isInteger(end_t)) {
-		throw std::runtime_error("anchor or target start and ends must be integer"); }
-	if (npts!=LENGTH(start_a) || npts!=LENGTH(start_t) || npts!=LENGTH(end_a) || npts!=LENGTH(end_t)) { 
-		throw std::runtime_error("lengths of coordinate vectors are not equal"); }
-	if (!isInteger(maxw) || LENGTH(maxw)!=1) { 
-		throw std::runtime_error("maximum width should be an integer scalar"); }
-
-	const int width=asInteger(maxw);
-	const int* asptr=INTEGER(start_a),
-		* aeptr=INTEGER(end_a),
-		* tsptr=INTEGER(start_t),
-		* teptr=INTEGER(end_t),
-		* iptr=INTEGER(id);
-
+void split_sweep(int npts, const int* iptr, const int* asptr, const int* tsptr, const int* aeptr, const int* teptr, int width, int* optr) {
 	// Getting the maximum ID, and constructing holding cells specifying the cluster starts and ends. 
 	int maxid=0;	
 	for (int i=0; i<npts; ++i) { 
 		if (maxid < iptr[i]) { maxid=iptr[i]; }
 	}
 	++maxid;
-	int* newas=(int*)R_alloc(maxid, sizeof(int));
-	for (int i=0; i<maxid; ++i) { newas[i]=-1; }
-	int* newts=(int*)R_alloc(maxid, sizeof(int));
-	int* newae=(int*)R_alloc(maxid, sizeof(int));
-	int* newte=(int*)R_alloc(maxid, sizeof(int));
+	std::vector<int> newas(maxid, -1), newts(maxid), newae(maxid), newte(maxid);
 
 	// Getting the extremes for the starts and ends.
 	for (int i=0; i<npts; ++i) {
@@ -314,10 +401,8 @@ SEXP split_clusters (SEXP id, SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t
 	}
 
 	// Going through each cluster and filling in the subinterval width.
-	double* newsuba=(double*)R_alloc(maxid, sizeof(double));
-	double* newsubt=(double*)R_alloc(maxid, sizeof(double));
-	int * newnumt =(int*)R_alloc(maxid, sizeof(int));
-	int * newidstart=(int*)R_alloc(maxid, sizeof(int));
+	std::vector<double> newsuba(maxid), newsubt(maxid);
+	std::vector<int> newnumt(maxid), newidstart(maxid);
 	double diff;
 	int mult, prod, last=1;
 
@@ -351,20 +436,33 @@ SEXP split_clusters (SEXP id, SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t
  	 * We use the midpoint of the original bins to decide if something should go in one place
  	 * or the other.
  	 */
+	for (int i=0; i<npts; ++i) {
+		const int& curid=iptr[i];
+		if (newas[curid]==-1) { continue; }
+		int& extra=(optr[i]=newidstart[curid]);
+		if (newsuba[curid]>0) {
+			extra+=int( (0.5*double(aeptr[i]+asptr[i])-newas[curid])/newsuba[curid] ) * newnumt[curid];
+		}
+		if (newsubt[curid]>0) {
+			extra+=int( (0.5*double(teptr[i]+tsptr[i])-newts[curid])/newsubt[curid] );
+		} 
+	}
+	return;
+}
+
+SEXP split_clusters (SEXP id, SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t, SEXP maxw) try {
+	if (!isInteger(id)) { throw std::runtime_error("cluster id values should be integer"); }
+	const int npts=LENGTH(id);
+	if (!isInteger(start_a) || !isInteger(start_t) || !isInteger(end_a) || !isInteger(end_t)) {
+		throw std::runtime_error("anchor or target start and ends must be integer"); }
+	if (npts!=LENGTH(start_a) || npts!=LENGTH(start_t) || npts!=LENGTH(end_a) || npts!=LENGTH(end_t)) { 
+		throw std::runtime_error("lengths of coordinate vectors are not equal"); }
+	if (!isInteger(maxw) || LENGTH(maxw)!=1) { 
+		throw std::runtime_error("maximum width should be an integer scalar"); }
+
 	SEXP output=PROTECT(allocVector(INTSXP, npts));
 	try {
-		int* optr=INTEGER(output);
-		for (int i=0; i<npts; ++i) {
-			const int& curid=iptr[i];
-			if (newas[curid]==-1) { continue; }
-			int& extra=(optr[i]=newidstart[curid]);
-			if (newsuba[curid]>0) {
-				extra+=int( (0.5*double(aeptr[i]+asptr[i])-newas[curid])/newsuba[curid] ) * newnumt[curid];
-			}
-			if (newsubt[curid]>0) {
-				extra+=int( (0.5*double(teptr[i]+tsptr[i])-newts[curid])/newsubt[curid] );
-			} 
-		}
+		split_sweep(npts, INTEGER(id), INTEGER(start_a), INTEGER(start_t), INTEGER(end_a), INTEGER(end_t), asInteger(maxw), INTEGER(output));
 	} catch (std::exception& e){
 		UNPROTECT(1);
 		throw;
@@ -0,0 +1,150 @@
+#include "clusters.h"
+
+/* This clusters bin pairs for all chromosome pairs at once. Points should be grouped 
+ * by chromosome pair, where 'sizes' specifies the number of points in each group.
+ * Clusters cannot cross chromosome pairs, so each group is clustered (and split, if 
+ * 'upper' is not NULL) separately in its own thread. Cluster IDs are then offset by 
+ * the number of clusters in all preceding groups, such that the output is the same 
+ * regardless of the number of threads. The bounding box of each cluster is also 
+ * computed, along with the (1-based) index of the first point in each cluster.
+ */
+
+struct sort_by_start {
+	sort_by_start(const int* a, const int* t) : aptr(a), tptr(t) {}
+	bool operator() (const int& l, const int& r) const {
+		if (aptr[l]!=aptr[r]) { return (aptr[l] < aptr[r]); }
+		if (tptr[l]!=tptr[r]) { return (tptr[l] < tptr[r]); }
+		return (l < r);
+	}
+private:
+	const int* aptr, * tptr;
+};
+
+void cluster_group(int npts, const int* asptr, const int* tsptr, const int* aeptr, const int* teptr, 
+		int width, bool split, int maxw, int* optr, int& nclusters) {
+	// Sorting by anchor and target starts, and clustering.
+	std::vector<int> ordering(npts);
+	for (int i=0; i<npts; ++i) { ordering[i]=i; }
+	std::sort(ordering.begin(), ordering.end(), sort_by_start(asptr, tsptr));
+	std::vector<int> sas(npts), sts(npts), sae(npts), ste(npts), sid(npts);
+	for (int i=0; i<npts; ++i) {
+		const int& o=ordering[i];
+		sas[i]=asptr[o];
+		sts[i]=tsptr[o];
+		sae[i]=aeptr[o];
+		ste[i]=teptr[o];
+	}
+	nclusters=cluster_sweep(npts, sas.data(), sts.data(), sae.data(), ste.data(), width, false, sid.data());
+	for (int i=0; i<npts; ++i) { optr[ordering[i]]=sid[i]; }
+	if (!split) { return; }
+
+	// Splitting large clusters, and renumbering the subclusters to keep the IDs consecutive.
+	split_sweep(npts, optr, asptr, tsptr, aeptr, teptr, maxw, sid.data());
+	int maxid=0;
+	for (int i=0; i<npts; ++i) {
+		if (sid[i] > maxid) { maxid=sid[i]; }
+	}
+	std::vector<int> renumbered(maxid+1);
+	for (int i=0; i<npts; ++i) { renumbered[sid[i]]=1; }
+	nclusters=0;
+	for (int i=0; i<=maxid; ++i) {
+		if (renumbered[i]) { renumbered[i]=++nclusters; }
+	}
+	for (int i=0; i<npts; ++i) { optr[i]=renumbered[sid[i]]; }
+	return;
+}
+
+SEXP cluster_pairs (SEXP start_a, SEXP start_t, SEXP end_a, SEXP end_t, SEXP sizes, SEXP tol, SEXP upper, SEXP nthreads) try {
+	if (!isInteger(start_a) || !isInteger(start_t) || !isInteger(end_a) || !isInteger(end_t)) {
+		throw std::runtime_error("anchor or target start and ends must be integer"); }
+	const int npts=LENGTH(start_a);
+	if (npts!=LENGTH(start_t) || npts!=LENGTH(end_a) || npts!=LENGTH(end_t)) { 
+		throw std::runtime_error("lengths of coordinate vectors are not equal"); }
+	if (!isInteger(sizes)) { throw std::runtime_error("group sizes should be an integer vector"); }
+	const int ngroups=LENGTH(sizes);
+	const int* gsptr=INTEGER(sizes);
+	std::vector<int> gstart(ngroups+1);
+	for (int g=0; g<ngroups; ++g) { 
+		if (gsptr[g] < 0) { throw std::runtime_error("group sizes should be non-negative"); }
+		gstart[g+1]=gstart[g]+gsptr[g]; 
+	}
+	if (gstart[ngroups]!=npts) { throw std::runtime_error("sum of group sizes should be equal to the number of points"); }
+
+	if (!isInteger(tol) || LENGTH(tol)!=1) { throw std::runtime_error("tolerance should be an integer scalar"); }
+	const int width=asInteger(tol);
+	const bool split=!isNull(upper);
+	int maxw=0;
+	if (split) {
+		if (!isInteger(upper) || LENGTH(upper)!=1) { throw std::runtime_error("maximum width should be an integer scalar"); }
+		maxw=asInteger(upper);
+	}
+	if (!isInteger(nthreads) || LENGTH(nthreads)!=1 || asInteger(nthreads) < 1) { 
+		throw std::runtime_error("number of threads should be a positive integer scalar"); }
+	const int nt=asInteger(nthreads);
+
+	const int* asptr=INTEGER(start_a),
+		* aeptr=INTEGER(end_a),
+		* tsptr=INTEGER(start_t),
+		* teptr=INTEGER(end_t);
+
+	SEXP output=PROTECT(allocVector(VECSXP, 6));
+try {
+	SET_VECTOR_ELT(output, 0, allocVector(INTSXP, npts));
+	int* optr=INTEGER(VECTOR_ELT(output, 0));
+
+	// Clustering each group in parallel. Exceptions cannot leave the parallel region, so we save the message instead.
+	std::vector<int> nclusters(ngroups);
+	std::string failure;
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+	for (int g=0; g<ngroups; ++g) {
+		try {
+			const int& s=gstart[g];
+			cluster_group(gsptr[g], asptr+s, tsptr+s, aeptr+s, teptr+s, width, split, maxw, optr+s, nclusters[g]);
+		} catch (std::exception& e) {
+#pragma omp critical
+			failure=e.what();
+		}
+	}
+	if (!failure.empty()) { throw std::runtime_error(failure); }
+
+	// Offsetting the IDs for each group.
+	std::vector<int> offsets(ngroups+1);
+	for (int g=0; g<ngroups; ++g) { offsets[g+1]=offsets[g]+nclusters[g]; }
+	const int ntotal=offsets[ngroups];
+	for (int k=1; k<6; ++k) { SET_VECTOR_ELT(output, k, allocVector(INTSXP, ntotal)); }
+	int* first_ptr=INTEGER(VECTOR_ELT(output, 1));
+	int* as_out=INTEGER(VECTOR_ELT(output, 2)), * ae_out=INTEGER(VECTOR_ELT(output, 3)),
+		* ts_out=INTEGER(VECTOR_ELT(output, 4)), * te_out=INTEGER(VECTOR_ELT(output, 5));
+	std::fill(first_ptr, first_ptr+ntotal, -1);
+
+	// Computing the bounding boxes; each group writes to its own range of clusters.
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+	for (int g=0; g<ngroups; ++g) {
+		const int& offset=offsets[g];
+		for (int i=gstart[g]; i<gstart[g+1]; ++i) {
+			int& curid=optr[i];
+			curid+=offset;
+			const int c=curid-1;
+			if (first_ptr[c]==-1) {
+				first_ptr[c]=i+1;
+				as_out[c]=asptr[i];
+				ae_out[c]=aeptr[i];
+				ts_out[c]=tsptr[i];
+				te_out[c]=teptr[i];
+			} else {
+				if (as_out[c] > asptr[i]) { as_out[c]=asptr[i]; } 
+				if (ae_out[c] < aeptr[i]) { ae_out[c]=aeptr[i]; }
+				if (ts_out[c] > tsptr[i]) { ts_out[c]=tsptr[i]; } 
+				if (te_out[c] < teptr[i]) { te_out[c]=teptr[i]; }
+			}
+		}
+	}
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
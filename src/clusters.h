@@ -0,0 +1,18 @@
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#include "diffhic.h"
+
+/* Single-linkage clustering of bin pairs in a chromosome pair. Points should be sorted 
+ * by anchor and target starts. Cluster IDs (starting from 1) are stored in the last 
+ * argument, and the number of clusters is returned. No R API functions are called 
+ * unless verbose output is requested, so this can be safely run in multiple threads.
+ */
+int cluster_sweep(int, const int*, const int*, const int*, const int*, int, bool, int*);
+
+/* Splitting of clusters into subclusters that are no larger than the specified width. 
+ * Subcluster IDs are stored in the last argument, and are not necessarily consecutive.
+ */
+void split_sweep(int, const int*, const int*, const int*, const int*, const int*, int, int*);
+
+#endif
@@ -0,0 +1,247 @@
+#include "diffhic.h"
+
+/* This fits a smooth surface of a response against three covariates for CNV normalization. Each
+ * covariate is scaled such that its range is split into 'ngrid' intervals of unit width, and points
+ * are summarized into grid cells by their mean covariates, mean response and number of points.
+ * A local linear fit is performed with tricube weights at each vertex of each non-empty cell,
+ * using the nearest cells containing a proportion 'span' of all points (weighted by the number of
+ * points in each cell) or the 'MINCELLS' nearest cells, whichever is larger. Fitted values for
+ * each point are then obtained by trilinear interpolation between the vertices of its cell.
+ */
+
+const int NCOVARIATES=3, MINCELLS=16;
+
+struct grid_cell {
+	grid_cell() : weight(0), response(0) { std::fill(location, location+NCOVARIATES, 0); }
+	double weight, response, location[NCOVARIATES];
+};
+
+/* Solving the weighted least squares system for the intercept. Covariates with negligible variance
+ * in the neighbourhood are dropped, which is valid as the system is positive semi-definite.
+ */
+
+double local_intercept(double (&xtwx)[NCOVARIATES+1][NCOVARIATES+1], double (&xtwy)[NCOVARIATES+1]) {
+	const int nparams=NCOVARIATES+1;
+	bool dropped[nparams];
+	for (int k=0; k<nparams; ++k) {
+		dropped[k]=!(xtwx[k][k] > 1e-10 * xtwx[0][0]);
+		if (dropped[k]) { continue; }
+		for (int r=k+1; r<nparams; ++r) {
+			const double mult=xtwx[r][k]/xtwx[k][k];
+			for (int c=k; c<nparams; ++c) { xtwx[r][c]-=mult*xtwx[k][c]; }
+			xtwy[r]-=mult*xtwy[k];
+		}
+	}
+
+	double coefs[nparams];
+	for (int k=nparams-1; k>=0; --k) {
+		if (dropped[k]) {
+			coefs[k]=0;
+			continue;
+		}
+		double val=xtwy[k];
+		for (int c=k+1; c<nparams; ++c) { val-=xtwx[k][c]*coefs[c]; }
+		coefs[k]=val/xtwx[k][k];
+	}
+	return coefs[0];
+}
+
+double local_fit(const std::vector<grid_cell>& cells, const double* point, const double span, const double total, std::vector<std::pair<double, int> >& distances) {
+	distances.clear();
+	for (size_t c=0; c<cells.size(); ++c) {
+		double dist2=0;
+		for (int d=0; d<NCOVARIATES; ++d) {
+			const double diff=cells[c].location[d]-point[d];
+			dist2+=diff*diff;
+		}
+		distances.push_back(std::make_pair(dist2, int(c)));
+	}
+	std::sort(distances.begin(), distances.end());
+
+	/* Identifying the bandwidth as the distance to the cell at which the cumulative weight exceeds the span.
+	 * We also include a minimum number of cells, to avoid an unstable fit when a few cells contain most points.
+	 */
+	const double target=span*total;
+	double cumulative=0, bandwidth=0;
+	for (size_t i=0; i<distances.size(); ++i) {
+		cumulative+=cells[distances[i].second].weight;
+		bandwidth=distances[i].first;
+		if (cumulative >= target && int(i) + 1 >= MINCELLS) { break; }
+	}
+	bandwidth=std::sqrt(bandwidth);
+	if (span > 1) { bandwidth*=std::pow(span, 1.0/NCOVARIATES); }
+	bandwidth=std::max(bandwidth * (1+1e-8), 1e-8);
+
+	double xtwx[NCOVARIATES+1][NCOVARIATES+1], xtwy[NCOVARIATES+1];
+	for (int r=0; r<=NCOVARIATES; ++r) {
+		xtwy[r]=0;
+		std::fill(xtwx[r], xtwx[r]+NCOVARIATES+1, 0);
+	}
+	for (size_t i=0; i<distances.size(); ++i) {
+		const double rel=std::sqrt(distances[i].first)/bandwidth;
+		if (rel >= 1) { break; }
+		const grid_cell& current=cells[distances[i].second];
+		const double tricube=1-rel*rel*rel;
+		const double w=current.weight * tricube * tricube * tricube;
+
+		double x[NCOVARIATES+1];
+		x[0]=1;
+		for (int d=0; d<NCOVARIATES; ++d) { x[d+1]=current.location[d]-point[d]; }
+		for (int r=0; r<=NCOVARIATES; ++r) {
+			xtwy[r]+=w*x[r]*current.response;
+			for (int c=0; c<=NCOVARIATES; ++c) { xtwx[r][c]+=w*x[r]*x[c]; }
+		}
+	}
+	return local_intercept(xtwx, xtwy);
+}
+
+void fit_grid_surface(const double** covariates, const double* response, const int npts, const int ngrid, const double span, double* output) {
+	if (npts==0) { return; }
+
+	// Scaling each covariate to grid units; constant covariates are collapsed to a single cell.
+	int ncells[NCOVARIATES], nverts[NCOVARIATES];
+	std::vector<double> scaled(size_t(npts)*NCOVARIATES);
+	for (int d=0; d<NCOVARIATES; ++d) {
+		const double* cov=covariates[d];
+		const double lower=*std::min_element(cov, cov+npts), upper=*std::max_element(cov, cov+npts);
+		const double width=(upper - lower)/ngrid;
+		ncells[d]=(width > 0 ? ngrid : 1);
+		nverts[d]=ncells[d]+1;
+		for (int i=0; i<npts; ++i) { scaled[size_t(i)*NCOVARIATES+d]=(width > 0 ? (cov[i] - lower)/width : 0); }
+	}
+
+	// Summarizing points into grid cells.
+	std::vector<int> assignment(npts);
+	std::vector<grid_cell> collected(ncells[0]*ncells[1]*ncells[2]);
+	for (int i=0; i<npts; ++i) {
+		const double* curpt=&(scaled[size_t(i)*NCOVARIATES]);
+		int& index=assignment[i];
+		index=0;
+		for (int d=0; d<NCOVARIATES; ++d) { index=index*ncells[d] + std::min(int(curpt[d]), ncells[d]-1); }
+
+		grid_cell& current=collected[index];
+		current.weight+=1;
+		current.response+=response[i];
+		for (int d=0; d<NCOVARIATES; ++d) { current.location[d]+=curpt[d]; }
+	}
+	std::vector<grid_cell> cells;
+	std::deque<int> nonempty;
+	for (size_t c=0; c<collected.size(); ++c) {
+		grid_cell& current=collected[c];
+		if (!current.weight) { continue; }
+		current.response/=current.weight;
+		for (int d=0; d<NCOVARIATES; ++d) { current.location[d]/=current.weight; }
+		cells.push_back(current);
+		nonempty.push_back(c);
+	}
+
+	// Fitting the surface at each vertex of each non-empty cell.
+	std::vector<double> vertices(nverts[0]*nverts[1]*nverts[2]);
+	std::vector<bool> fitted(vertices.size());
+	std::vector<std::pair<double, int> > distances;
+	for (std::deque<int>::const_iterator nIt=nonempty.begin(); nIt!=nonempty.end(); ++nIt) {
+		int position[NCOVARIATES], remainder=*nIt;
+		for (int d=NCOVARIATES-1; d>=0; --d) {
+			position[d]=remainder % ncells[d];
+			remainder/=ncells[d];
+		}
+
+		for (int corner=0; corner < (1 << NCOVARIATES); ++corner) {
+			int vindex=0;
+			double vpoint[NCOVARIATES];
+			for (int d=0; d<NCOVARIATES; ++d) {
+				const int curpos=position[d] + ((corner >> d) & 1);
+				vindex=vindex*nverts[d] + curpos;
+				vpoint[d]=curpos;
+			}
+			if (!fitted[vindex]) {
+				vertices[vindex]=local_fit(cells, vpoint, span, npts, distances);
+				fitted[vindex]=true;
+			}
+		}
+	}
+
+	// Interpolating back to each point.
+	for (int i=0; i<npts; ++i) {
+		const double* curpt=&(scaled[size_t(i)*NCOVARIATES]);
+		int position[NCOVARIATES], remainder=assignment[i];
+		for (int d=NCOVARIATES-1; d>=0; --d) {
+			position[d]=remainder % ncells[d];
+			remainder/=ncells[d];
+		}
+
+		double& curout=(output[i]=0);
+		for (int corner=0; corner < (1 << NCOVARIATES); ++corner) {
+			int vindex=0;
+			double w=1;
+			for (int d=0; d<NCOVARIATES; ++d) {
+				const int offset=(corner >> d) & 1;
+				const double frac=curpt[d] - position[d];
+				w*=(offset ? frac : 1 - frac);
+				vindex=vindex*nverts[d] + position[d] + offset;
+			}
+			if (w) { curout+=w*vertices[vindex]; }
+		}
+	}
+	return;
+}
+
+extern "C" {
+
+/* Surfaces are fitted for each library in parallel. The first two covariates are specific to each
+ * library while the abundance is shared across libraries.
+ */
+
+SEXP cnv_grid_offsets(SEXP mfc1, SEXP mfc2, SEXP abundance, SEXP response, SEXP grid, SEXP span, SEXP nthreads) try {
+	if (!isReal(abundance)) { throw std::runtime_error("abundances must be double-precision"); }
+	const int npts=LENGTH(abundance);
+	if (!isReal(mfc1) || !isReal(mfc2) || !isReal(response)) { throw std::runtime_error("covariate and response matrices must be double-precision"); }
+	if (LENGTH(mfc1)!=LENGTH(response) || LENGTH(mfc2)!=LENGTH(response)) { throw std::runtime_error("covariate and response matrices must have the same dimensions"); }
+	const int nlibs=ncols(response);
+	if (nrows(response)!=npts) { throw std::runtime_error("number of rows in the response matrix should be equal to the number of abundances"); }
+	if (!isInteger(grid) || LENGTH(grid)!=1 || asInteger(grid) < 1) { throw std::runtime_error("grid size should be a positive integer scalar"); }
+	const int ngrid=asInteger(grid);
+	if (!isReal(span) || LENGTH(span)!=1 || !(asReal(span) > 0)) { throw std::runtime_error("span should be a positive double-precision scalar"); }
+	const double sp=asReal(span);
+	if (!isInteger(nthreads) || LENGTH(nthreads)!=1 || asInteger(nthreads) < 1) {
+		throw std::runtime_error("number of threads should be a positive integer scalar"); }
+	const int nt=asInteger(nthreads);
+
+	const double* m1ptr=REAL(mfc1), * m2ptr=REAL(mfc2), * abptr=REAL(abundance), * rptr=REAL(response);
+	const size_t total=size_t(npts)*nlibs;
+	for (size_t i=0; i<total; ++i) {
+		if (!R_FINITE(m1ptr[i]) || !R_FINITE(m2ptr[i]) || !R_FINITE(rptr[i])) { throw std::runtime_error("covariates and responses must be finite"); }
+	}
+	for (int i=0; i<npts; ++i) {
+		if (!R_FINITE(abptr[i])) { throw std::runtime_error("abundances must be finite"); }
+	}
+
+	SEXP output=PROTECT(allocMatrix(REALSXP, npts, nlibs));
+try {
+	double* optr=REAL(output);
+
+	// Exceptions cannot leave the parallel region, so we save the message instead.
+	std::string failure;
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+	for (int lib=0; lib<nlibs; ++lib) {
+		try {
+			const size_t offset=size_t(lib)*npts;
+			const double* covariates[NCOVARIATES]={ m1ptr+offset, m2ptr+offset, abptr };
+			fit_grid_surface(covariates, rptr+offset, npts, ngrid, sp, optr+offset);
+		} catch (std::exception& e) {
+#pragma omp critical
+			failure=e.what();
+		}
+	}
+	if (!failure.empty()) { throw std::runtime_error(failure); }
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+}
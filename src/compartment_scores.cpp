@@ -0,0 +1,205 @@
+#include "diffhic.h"
+
+/* This computes the leading eigenvector of the matrix of Pearson correlations between the rows of
+ * a sparse, symmetric observed/expected matrix, where absent bin pairs have values of zero. The
+ * correlation matrix is never formed; instead, we define Z as the row-centred and scaled matrix
+ * such that the correlation matrix is Z * Z^T, and apply power iteration with two sparse matrix-
+ * vector multiplications (plus rank-1 corrections for the centring) per iteration. Bins with
+ * zero variance across the row are ignored and receive NA scores.
+ */
+
+struct sparse_symmetric {
+	sparse_symmetric(const int n) : nbins(n), first(n+1) {}
+	void multiply(const double* in, double* out) const {
+		for (int b=0; b<nbins; ++b) {
+			double& curout=(out[b]=0);
+			for (int j=first[b]; j<first[b+1]; ++j) { curout+=values[j]*in[index[j]]; }
+		}
+		return;
+	}
+	const int nbins;
+	std::vector<int> first, index;
+	std::vector<double> values;
+};
+
+bool leading_correlation_vector (const sparse_symmetric& mat, const int maxit, const double tol, double* output) {
+	const int& n=mat.nbins;
+
+	// Computing the row means and inverse standard deviations.
+	std::vector<double> means(n), scale(n);
+	for (int b=0; b<n; ++b) {
+		double sum=0, sumsq=0;
+		for (int j=mat.first[b]; j<mat.first[b+1]; ++j) {
+			sum+=mat.values[j];
+			sumsq+=mat.values[j]*mat.values[j];
+		}
+		means[b]=sum/n;
+		const double var=sumsq/n - means[b]*means[b];
+		scale[b]=(var > 0 ? 1/std::sqrt(var*n) : 0);
+	}
+
+	// Starting from a fixed vector, for reproducibility.
+	std::vector<double> current(n), buffer(n), next(n);
+	for (int b=0; b<n; ++b) { current[b]=(scale[b] ? 1 + std::sin(double(b+1)) : 0); }
+	bool converged=false;
+	for (int it=0; it<maxit; ++it) {
+		// Computing Z^T * v = M * D * v - 1 * (mu^T * D * v).
+		double shift=0;
+		for (int b=0; b<n; ++b) {
+			buffer[b]=current[b]*scale[b];
+			shift+=means[b]*buffer[b];
+		}
+		mat.multiply(buffer.data(), next.data());
+		double total=0;
+		for (int b=0; b<n; ++b) {
+			next[b]-=shift;
+			total+=next[b];
+		}
+
+		// Computing Z * w = D * (M * w - mu * (1^T * w)).
+		mat.multiply(next.data(), buffer.data());
+		double norm=0;
+		for (int b=0; b<n; ++b) {
+			buffer[b]=(buffer[b] - means[b]*total)*scale[b];
+			norm+=buffer[b]*buffer[b];
+		}
+		norm=std::sqrt(norm);
+		if (norm==0) {
+			converged=true;
+			break;
+		}
+
+		double change=0;
+		for (int b=0; b<n; ++b) {
+			buffer[b]/=norm;
+			change=std::max(change, std::abs(buffer[b]-current[b]));
+		}
+		current.swap(buffer);
+		if (change < tol) {
+			converged=true;
+			break;
+		}
+	}
+
+	for (int b=0; b<n; ++b) { output[b]=(scale[b] ? current[b] : R_NaReal); }
+	return converged;
+}
+
+extern "C" {
+
+/* This computes compartment scores for each chromosome in parallel. Bin pairs should be sorted by
+ * the first anchor, and both anchors of each bin pair should lie on the same chromosome. Bins that
+ * are not 'active' are ignored and receive NA scores. This also reports whether power iteration
+ * converged within 'iterations' for each chromosome.
+ */
+
+SEXP compartment_scores (SEXP anchor1, SEXP anchor2, SEXP values, SEXP chrends, SEXP active, SEXP iterations, SEXP tol, SEXP nthreads) try {
+	if (!isInteger(anchor1) || !isInteger(anchor2)) { throw std::runtime_error("anchor indices must be integer"); }
+	const int npairs=LENGTH(anchor1);
+	if (!isReal(values) || LENGTH(values)!=npairs || LENGTH(anchor2)!=npairs) { throw std::runtime_error("values must be a double-precision vector of length equal to the number of bin pairs"); }
+	const int* a1ptr=INTEGER(anchor1), * a2ptr=INTEGER(anchor2);
+	const double* vptr=REAL(values);
+
+	if (!isInteger(chrends)) { throw std::runtime_error("chromosome end indices must be integer"); }
+	const int nchrs=LENGTH(chrends);
+	const int* cptr=INTEGER(chrends);
+	if (!isLogical(active)) { throw std::runtime_error("active bin specification must be a logical vector"); }
+	const int nbins=LENGTH(active);
+	const int* actptr=LOGICAL(active);
+	if (!isInteger(iterations) || LENGTH(iterations)!=1 || asInteger(iterations) < 1) { throw std::runtime_error("number of iterations must be a positive integer scalar"); }
+	const int maxit=asInteger(iterations);
+	if (!isReal(tol) || LENGTH(tol)!=1 || !(asReal(tol) >= 0)) { throw std::runtime_error("tolerance should be a non-negative double-precision scalar"); }
+	const double tolerance=asReal(tol);
+	if (!isInteger(nthreads) || LENGTH(nthreads)!=1 || asInteger(nthreads) < 1) {
+		throw std::runtime_error("number of threads should be a positive integer scalar"); }
+	const int nt=asInteger(nthreads);
+
+	// Identifying the bins and bin pairs for each chromosome.
+	std::vector<int> chrstarts(nchrs+1), pairstarts(nchrs+1);
+	int curpair=0;
+	for (int c=0; c<nchrs; ++c) {
+		const int& curend=cptr[c];
+		if (curend < chrstarts[c] || curend > nbins) { throw std::runtime_error("invalid chromosome end indices"); }
+		chrstarts[c+1]=curend;
+		while (curpair < npairs && a1ptr[curpair] < curend) {
+			if (a1ptr[curpair] < chrstarts[c] || a2ptr[curpair] < chrstarts[c] || a2ptr[curpair] >= curend) {
+				throw std::runtime_error("bin pairs should be intra-chromosomal and sorted by the first anchor"); }
+			if (!R_FINITE(vptr[curpair])) { throw std::runtime_error("values must be finite"); }
+			++curpair;
+		}
+		pairstarts[c+1]=curpair;
+	}
+	if (curpair!=npairs || chrstarts[nchrs]!=nbins) { throw std::runtime_error("failed to assign all bins and bin pairs to chromosomes"); }
+
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+try {
+	SET_VECTOR_ELT(output, 0, allocVector(REALSXP, nbins));
+	double* optr=REAL(VECTOR_ELT(output, 0));
+	std::fill(optr, optr+nbins, R_NaReal);
+	SET_VECTOR_ELT(output, 1, allocVector(LGLSXP, nchrs));
+	int* convptr=LOGICAL(VECTOR_ELT(output, 1));
+
+	// Exceptions cannot leave the parallel region, so we save the message instead.
+	std::string failure;
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+	for (int c=0; c<nchrs; ++c) {
+		try {
+			// Mapping the active bins to local indices.
+			const int& cstart=chrstarts[c];
+			std::vector<int> local(chrstarts[c+1]-cstart, -1), global;
+			for (int b=cstart; b<chrstarts[c+1]; ++b) {
+				if (actptr[b]==1) {
+					local[b-cstart]=global.size();
+					global.push_back(b);
+				}
+			}
+
+			// Filling the symmetric matrix in compressed sparse row format.
+			sparse_symmetric mat(global.size());
+			for (int p=pairstarts[c]; p<pairstarts[c+1]; ++p) {
+				const int& l1=local[a1ptr[p]-cstart];
+				const int& l2=local[a2ptr[p]-cstart];
+				if (l1 < 0 || l2 < 0) { continue; }
+				++mat.first[l1+1];
+				if (l1!=l2) { ++mat.first[l2+1]; }
+			}
+			for (int b=0; b<mat.nbins; ++b) { mat.first[b+1]+=mat.first[b]; }
+			mat.index.resize(mat.first[mat.nbins]);
+			mat.values.resize(mat.first[mat.nbins]);
+			std::vector<int> cursor(mat.first.begin(), mat.first.end()-1);
+			for (int p=pairstarts[c]; p<pairstarts[c+1]; ++p) {
+				const int& l1=local[a1ptr[p]-cstart];
+				const int& l2=local[a2ptr[p]-cstart];
+				if (l1 < 0 || l2 < 0) { continue; }
+				int& cur1=cursor[l1];
+				mat.index[cur1]=l2;
+				mat.values[cur1]=vptr[p];
+				++cur1;
+				if (l1!=l2) {
+					int& cur2=cursor[l2];
+					mat.index[cur2]=l1;
+					mat.values[cur2]=vptr[p];
+					++cur2;
+				}
+			}
+
+			std::vector<double> scores(mat.nbins);
+			convptr[c]=leading_correlation_vector(mat, maxit, tolerance, scores.data());
+			for (size_t i=0; i<global.size(); ++i) { optr[global[i]]=scores[i]; }
+		} catch (std::exception& e) {
+#pragma omp critical
+			failure=e.what();
+		}
+	}
+	if (!failure.empty()) { throw std::runtime_error(failure); }
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+}
@@ -1,5 +1,110 @@
 #include "read_count.h"
 #include "neighbors.h"
+#include "summed_area.h"
+
+/* This class holds the sliding window of reference bin pairs that are used to compute the
+ * neighbourhood counts. Each field is stored in its own growable vector, with the counts for all 
+ * libraries of each bin pair stored contiguously. Dropping old bin pairs from the front of the window
+ * only advances 'start'; the dead prefix is erased once it is larger than the live entries, such 
+ * that the cost of shifting is amortized and the capacity stays at the largest window size.
+ */
+
+class ref_window {
+public:
+	ref_window(int nl) : nlibs(nl), start(0) {}
+	size_t size() const { return anchors.size()-start; }
+	int anchor(size_t i) const { return anchors[start+i]; }
+	int target(size_t i) const { return targets[start+i]; }
+	const int* count(size_t i) const { return counts.data() + (start+i)*nlibs; }
+	int last_anchor() const { return anchors.back(); }
+
+	void push_back(int a, int t, const int* c) {
+		anchors.push_back(a);
+		targets.push_back(t);
+		counts.insert(counts.end(), c, c+nlibs);
+	}
+	void pop_front(size_t n) {
+		start+=n;
+		if (start > size()) { 
+			anchors.erase(anchors.begin(), anchors.begin()+start);
+			targets.erase(targets.begin(), targets.begin()+start);
+			counts.erase(counts.begin(), counts.begin()+start*nlibs);
+			start=0;
+		}
+	}
+private:
+	const int nlibs;
+	size_t start;
+	std::vector<int> anchors, targets, counts;
+};
+
+/* This computes the neighbourhood counts at all levels for all bin pairs with anchors of 'saved_anchor',
+ * from 'saved_dex' to 'saved_end'. It is templated on the neighbourhood class so that calls to set() can 
+ * be inlined. Counts and areas are added to the per-library columns of the output buffers.
+ *
+ * If a bump_level results in an increase in desired_anchor, we can hot-start 
+ * from the existing left/rightdex from the last level (i.e., no need to reset to 
+ * zero within the loop). Both indices MUST increase (even when saved_copy_dex 
+ * is reset to saved_dex) as they've been stuck on the previous desired_anchor.
+ *
+ * If bumping doesn't result in an increase, we need to hot-start from the 
+ * previous left/rightdex that we used for the current level. This necessitates
+ * storing of the last_anchor and the last left/right indices. We also need 
+ * to store the temporary counts corresponding to those indices.
+ *
+ * Note that we reset to zero in quadrant_bg, which needs to calculate the 
+ * neighbourhood across _all_ pairs; not just those at a particular anchor.
+ */
+
+template<class Shape>
+void collect_neighborhood(Shape& shape, const int saved_anchor, const int saved_dex, const int saved_end, const int* targets, 
+		const ref_window& window, const int nabins, int& leftdex, int& rightdex, 
+		std::vector<int>& temp, std::vector<int>& last_temp, std::vector<int>& curarea, std::vector<std::vector<int> >& curcounts) {
+
+	const int nlibs=temp.size(), fullsize=window.size();
+	int last_anchor=-1, last_leftdex=0, last_rightdex=0, desired_anchor, leftbound, rightbound, saved_copy_dex, curlib;
+	std::fill(temp.begin(), temp.end(), 0);
+
+	do { 
+		shape.set(saved_anchor, 0); // Dummy input to get desired_anchor.
+		desired_anchor=shape.row;
+		if (desired_anchor < 0 || desired_anchor >= nabins) { continue; }
+		if (last_anchor==desired_anchor) {
+			leftdex=last_leftdex;
+			rightdex=last_rightdex;
+			std::copy(last_temp.begin(), last_temp.end(), temp.begin());
+		} else {
+			last_anchor=desired_anchor;
+			last_leftdex=leftdex;
+			last_rightdex=rightdex;
+			std::copy(temp.begin(), temp.end(), last_temp.begin());
+		}
+		
+		for (saved_copy_dex=saved_dex; saved_copy_dex < saved_end; ++saved_copy_dex) { 
+			shape.set(saved_anchor, targets[saved_copy_dex]);
+			leftbound=shape.left;
+			rightbound=shape.right;
+
+			// Identifying all reference elements associated with the neighborhood of this saved_copy_dex at the current level.
+			while (rightdex < fullsize && (window.anchor(rightdex) < desired_anchor || 
+						(window.anchor(rightdex)==desired_anchor && window.target(rightdex) < rightbound))) { 
+				const int* current=window.count(rightdex);
+				for (curlib=0; curlib<nlibs; ++curlib) { temp[curlib]+=current[curlib]; }
+				++rightdex;
+			}
+			while (leftdex < fullsize && (window.anchor(leftdex) < desired_anchor || 
+						(window.anchor(leftdex)==desired_anchor && window.target(leftdex) < leftbound))) {
+				const int* current=window.count(leftdex);
+				for (curlib=0; curlib<nlibs; ++curlib) { temp[curlib]-=current[curlib]; }
+				++leftdex;
+			}
+
+			curarea[saved_copy_dex]+=rightbound-leftbound;
+			for (curlib=0; curlib<nlibs; ++curlib) { curcounts[curlib][saved_copy_dex]+=temp[curlib]; }
+		}
+	} while (shape.bump_level());
+	return;
+}
 
 SEXP count_background(SEXP all, SEXP bin, SEXP back_width, SEXP exclude_width, SEXP filter, 
 		SEXP first_target_bin, SEXP last_target_bin, SEXP first_anchor_bin, SEXP last_anchor_bin) try {
@@ -21,180 +126,110 @@ SEXP count_background(SEXP all, SEXP bin, SEXP back_width, SEXP exclude_width, S
 	if (!isInteger(last_anchor_bin) || LENGTH(last_anchor_bin)!=1) { throw std::runtime_error("index of last bin on anchor chromosome must be an integer scalar"); }
 	const int labin=asInteger(last_anchor_bin);
 	const bool intra=(fabin==ftbin);
+	const int ntbins=ltbin-ftbin+1, nabins=labin-fabin+1;
+	int countsum, curlib, mode;
 
 	// Setting up the binning engine.
 	binner engine(all, bin, ftbin, ltbin);
 	const int nlibs=engine.get_nlibs();
+	const int nmodes=4, startmode=(intra ? 0 : 1);
 
-	// Setting up the memory containers.
-	const int ntbins=ltbin-ftbin+1, nabins=labin-fabin+1;
-	std::deque<int> counts, anchors, targets;
-
-	// Stuff required to compute the neighborhood.
-	std::deque<int> ref_targets, ref_anchors;
-	std::deque<std::deque<int> > ref_count(nlibs);
-	const size_t nmodes=4, startmode=(intra ? 0 : 1);
-    size_t mode;
-    std::deque<std::deque<int> > neighborcount(nmodes), neighborarea(nmodes);
-
-    basic * base_ptr=NULL;
-	size_t saved_dex=0; // Points to the entry in 'anchors' to be interrogated.
-	int ref_matching_dex=0; // Points to entry in 'ref_anchors' matching anchor for previous 'saved_dex'.
-	size_t n_to_drop;
+	/* Bin pairs above the filter are stored in growable buffers, with one column for each library
+	 * (and for the neighbourhood counts and areas in each mode), so only a single pass through 
+	 * the binning engine is required. These are copied into the output matrices at the end.
+	 */
+	std::vector<int> kept_anchors, kept_targets;
+	std::vector<std::vector<int> > kept_counts(nlibs);
+	std::vector<std::vector<int> > kept_areas(nmodes);
+	std::vector<std::vector<std::vector<int> > > kept_neighbors(nmodes, std::vector<std::vector<int> >(nlibs));
 
-	// Other assorted sundries.
-	int rowdex, countsum, curlib, curanchor;
-	int leftbound, rightbound, leftdex, rightdex, desired_anchor;
-   	size_t saved_copy_dex;
-    std::deque<int>::const_iterator ccIt, wcIt;
+	/* Stuff required to compute the neighborhood. The reference window needs to span
+	 * at least 2*bwidth+1 anchors, each of which contains some bin pairs.
+	 */
+	ref_window window(nlibs);
+	std::vector<int> temp(nlibs), last_temp(nlibs);
+	int saved_dex=0; // Points to the entry in the kept buffers to be interrogated.
+	int ref_matching_dex=0; // Points to entry in 'window' matching anchor for previous 'saved_dex'.
+	int leftdex, rightdex, curanchor;
+	size_t n_to_drop;
 
 	while (1) { 
 		if (!engine.empty()) {
 			engine.fill();
 			curanchor=engine.get_anchor() - fabin;
-            const std::deque<int>& waschanged=engine.get_changed();
-            const std::deque<int>& curcounts=engine.get_counts();
-
-            for (wcIt=waschanged.begin(); wcIt!=waschanged.end(); ++wcIt) {
-				rowdex=(*wcIt)*nlibs;
-                ccIt=curcounts.begin()+rowdex;
-
-                // Adding values for neighbourhood calculations.
-				ref_anchors.push_back(curanchor);
-				ref_targets.push_back(*wcIt);
-                countsum=0;
-				for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
-                    const int& curcount=*ccIt;
-                    ref_count[curlib].push_back(curcount);
-                    countsum+=curcount;
-                }
-
-			    // Adding it to the main list, if it's large enough.
+			const std::vector<int>& waschanged=engine.get_changed();
+			const int* ccptr=engine.get_counts().data();
+
+			for (size_t w=0; w<waschanged.size(); ++w, ccptr+=nlibs) {
+				// Adding values for neighbourhood calculations.
+				window.push_back(curanchor, waschanged[w], ccptr);
+				countsum=0;
+				for (curlib=0; curlib<nlibs; ++curlib) { countsum+=ccptr[curlib]; }
+
+				// Adding it to the kept buffers, if it's large enough (anchors/targets are shifted back later).
 				if (countsum >= f) { 
-					anchors.push_back(curanchor);
-					targets.push_back(ref_targets.back());
-                    ccIt-=nlibs;
-					for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
-                        counts.push_back(*ccIt);
-                    }
+					kept_anchors.push_back(curanchor);
+					kept_targets.push_back(waschanged[w]);
+					for (curlib=0; curlib<nlibs; ++curlib) { kept_counts[curlib].push_back(ccptr[curlib]); }
+					for (mode=0; mode<nmodes; ++mode) { 
+						kept_areas[mode].push_back(0);
+						for (curlib=0; curlib<nlibs; ++curlib) { kept_neighbors[mode][curlib].push_back(0); }
+					}
 				}
 			}
-
-			// Matching sizes of the vectors.
-			for (mode=startmode; mode<nmodes; ++mode) { 
-				neighborarea[mode].resize(anchors.size());
-				neighborcount[mode].resize(counts.size()); 
-			} 
 		}
 
-        /* Computing neighbourhoods if there are enough anchors collected to define the neighbourhood of 'saved_dex',
-         * or if no new information is to be added from the binning engine.
-         */
-		if (saved_dex < anchors.size() && (engine.empty() || ref_anchors.back() >= anchors[saved_dex] + bwidth)) { 
+		/* Computing neighbourhoods if there are enough anchors collected to define the neighbourhood of 'saved_dex',
+		 * or if no new information is to be added from the binning engine.
+		 */
+		const int nkept=kept_anchors.size();
+		if (saved_dex < nkept && (engine.empty() || window.last_anchor() >= kept_anchors[saved_dex] + bwidth)) { 
 			bottomright br(bwidth, ntbins, intra, xwidth);
 			leftright lr(bwidth, ntbins, intra, xwidth);
 			updown ud(bwidth, ntbins, intra, xwidth);
 			allaround aa(bwidth, ntbins, intra, xwidth);
 
-            const int& saved_anchor=anchors[saved_dex];
-			int fullsize=ref_anchors.size();
-            std::deque<int> temp(nlibs), last_temp(nlibs);
+			const int saved_anchor=kept_anchors[saved_dex];
+			int saved_end=saved_dex;
+			while (saved_end < nkept && kept_anchors[saved_end]==saved_anchor) { ++saved_end; } 
+			const int* toptr=kept_targets.data();
 
-			// Computing the neighborhood count for all bin pairs with anchors of 'anchors[saved_dex]'.
+			// Computing the neighborhood count for all bin pairs with anchors of 'saved_anchor'.
 			for (mode=startmode; mode<nmodes; ++mode) { 
 				leftdex=rightdex=0;
-                std::deque<int>& curarea=neighborarea[mode];
-                std::deque<int>& curcounts=neighborcount[mode];
-                std::fill(temp.begin(), temp.end(), 0);
+				if (mode==2) { 
+					leftdex=rightdex=ref_matching_dex; // starting from the stretch in 'window' that is past the previous 'saved_anchor'.
+				}
 
+				std::vector<int>& curarea=kept_areas[mode];
+				std::vector<std::vector<int> >& curcounts=kept_neighbors[mode];
 				switch (mode) {
-					case 0: base_ptr=&br; break;
-					case 1: base_ptr=&ud; break;
-					case 2: 
-                        base_ptr=&lr; 
-                        leftdex=rightdex=ref_matching_dex; // starting from the stretch in ref_anchors that is past the previous 'saved_anchor'.
-                        break;
-					case 3: base_ptr=&aa; break;	
+					case 0: collect_neighborhood(br, saved_anchor, saved_dex, saved_end, toptr, window, nabins, leftdex, rightdex, temp, last_temp, curarea, curcounts); break;
+					case 1: collect_neighborhood(ud, saved_anchor, saved_dex, saved_end, toptr, window, nabins, leftdex, rightdex, temp, last_temp, curarea, curcounts); break;
+					case 2: collect_neighborhood(lr, saved_anchor, saved_dex, saved_end, toptr, window, nabins, leftdex, rightdex, temp, last_temp, curarea, curcounts); break;
+					case 3: collect_neighborhood(aa, saved_anchor, saved_dex, saved_end, toptr, window, nabins, leftdex, rightdex, temp, last_temp, curarea, curcounts); break;
 				}
 
-				/* If a bump_level results in an increase in desired_anchor, we can hot-start 
-				 * from the existing left/rightdex from the last level (i.e., no need to reset to 
-				 * zero within the loop). Both indices MUST increase (even when saved_copy_dex 
-				 * is reset to saved_dex) as they've been stuck on the previous desired_anchor.
-                 *
-                 * If bumping doesn't result in an increase, we need to hot-start from the 
-                 * previous left/rightdex that we used for the current level. This necessitates
-                 * storing of the last_anchor and the last left/right indices. We also need 
-                 * to store the temporary counts corresponding to those indices.
-                 *
-                 * Note that we reset to zero in quadrant_bg, which needs to calculate the 
-                 * neighbourhood across _all_ pairs; not just those at a particular anchor.
-				 */
-                int last_anchor=-1, last_leftdex=0, last_rightdex=0;
-				do { 
-   	        		base_ptr->set(saved_anchor, 0); // Dummy input to get desired_anchor.
-                    desired_anchor=base_ptr->row;
-				    if (desired_anchor < 0 || desired_anchor >= nabins) { continue; }
-                    if (last_anchor==desired_anchor) {
-                        leftdex=last_leftdex;
-                        rightdex=last_rightdex;
-                        std::copy(last_temp.begin(), last_temp.end(), temp.begin());
-                    } else {
-                        last_anchor=desired_anchor;
-                        last_leftdex=leftdex;
-                        last_rightdex=rightdex;
-                        std::copy(temp.begin(), temp.end(), last_temp.begin());
-                    }
-                    
-					for (saved_copy_dex=saved_dex; saved_copy_dex < anchors.size() && 
-							anchors[saved_copy_dex]==saved_anchor; ++saved_copy_dex) { 
-						base_ptr->set(saved_anchor, targets[saved_copy_dex]);
-						leftbound=base_ptr->left;
-						rightbound=base_ptr->right;
-
-						// Identifying all reference elements associated with the neighborhood of this saved_copy_dex at the current level.
-						while (rightdex < fullsize && (ref_anchors[rightdex] < desired_anchor || 
-									(ref_anchors[rightdex]==desired_anchor && ref_targets[rightdex] < rightbound))) { 
-                            for (curlib=0; curlib<nlibs; ++curlib) { temp[curlib]+=ref_count[curlib][rightdex]; }
-							++rightdex;
-						}
-						while (leftdex < fullsize && (ref_anchors[leftdex] < desired_anchor || 
-									(ref_anchors[leftdex]==desired_anchor && ref_targets[leftdex] < leftbound))) {
-                            for (curlib=0; curlib<nlibs; ++curlib) { temp[curlib]-=ref_count[curlib][leftdex]; }
-							++leftdex;
-						}
-		
-						curarea[saved_copy_dex]+=rightbound-leftbound;
-                        rowdex=saved_copy_dex*nlibs;
-                        for (curlib=0; curlib<nlibs; ++curlib) { curcounts[rowdex+curlib]+=temp[curlib]; }
-					}
-				} while (base_ptr->bump_level());
-
-				/* Storing the location on ref_anchors where 'saved_anchor' terminates, to hotstart for
+				/* Storing the location on 'window' where 'saved_anchor' terminates, to hotstart for
 				 * the next 'saved_anchor' for 'leftright' (as it only operates within the same anchor values).
 				 */
 				if (mode==2) { ref_matching_dex=rightdex; }
 			}
 			
-            // Shifting onwards to the next 'saved_anchor'.
-			while (saved_dex < anchors.size() && anchors[saved_dex]==saved_anchor) { ++saved_dex; } 
+			// Shifting onwards to the next 'saved_anchor'.
+			saved_dex=saved_end;
 		}
 
-		// Dropping elements in the reference data that will no longer be used, to save memory.
-		if (saved_dex < anchors.size()) { 
+		// Dropping elements in the reference window that will no longer be used.
+		if (saved_dex < nkept) { 
 			n_to_drop=0;
-			while (n_to_drop < ref_anchors.size() && ref_anchors[n_to_drop] < anchors[saved_dex] - bwidth) { ++n_to_drop; }
+			while (n_to_drop < window.size() && window.anchor(n_to_drop) < kept_anchors[saved_dex] - bwidth) { ++n_to_drop; }
 			if (n_to_drop) { 
-				ref_anchors.erase(ref_anchors.begin(), ref_anchors.begin()+n_to_drop);
-				ref_targets.erase(ref_targets.begin(), ref_targets.begin()+n_to_drop);
-                for (curlib=0; curlib<nlibs; ++curlib) { 
-                    std::deque<int>& cur_count=ref_count[curlib];
-                    cur_count.erase(cur_count.begin(), cur_count.begin()+n_to_drop);
-                }
+				window.pop_front(n_to_drop);
 
 				/* The 'matching_dex' gets pulled down as well. It's possible that the next 'saved_anchor'
-				 * skips a couple of ref_anchors, so the number dropped might include 'matching_dex'. In
-				 * that case, we just start from zero during the neighborhood calculations.
+				 * skips a couple of anchors in the window, so the number dropped might include 'matching_dex'. 
+				 * In that case, we just start from zero during the neighborhood calculations.
 				 */
 				ref_matching_dex-=n_to_drop;
 				if (ref_matching_dex < 0) { ref_matching_dex=0; }
@@ -202,73 +237,144 @@ SEXP count_background(SEXP all, SEXP bin, SEXP back_width, SEXP exclude_width, S
 		} else if (engine.empty()) { break; }
 	}
 
-	// Storing into R objects.
+	// Copying the kept buffers into the output, converting back to the original bin indices.
+	const int ncombos=kept_anchors.size();
 	SEXP output=PROTECT(allocVector(VECSXP, 5));
 	try {
-		const int ncombos=anchors.size();
 		SET_VECTOR_ELT(output, 0, allocVector(INTSXP, ncombos));
 		int* aoptr=INTEGER(VECTOR_ELT(output, 0));
 		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, ncombos));
 		int* toptr=INTEGER(VECTOR_ELT(output, 1));
+		for (int i=0; i<ncombos; ++i) {
+			aoptr[i]=kept_anchors[i]+fabin;
+			toptr[i]=kept_targets[i]+ftbin;
+		}
 		SET_VECTOR_ELT(output, 2, allocMatrix(INTSXP, ncombos, nlibs));
-		
-		std::deque<int*> coptrs(nlibs);
-		for (curlib=0; curlib<nlibs; ++curlib) {
-			if (curlib==0) { coptrs[curlib]=INTEGER(VECTOR_ELT(output, 2)); } 
-			else { coptrs[curlib]=coptrs[curlib-1]+ncombos; }
-		}	
-	
-        // Storing the count statistics for each neighbourhood.
+		int* coptr=INTEGER(VECTOR_ELT(output, 2));
+		for (curlib=0; curlib<nlibs; ++curlib) { 
+			std::copy(kept_counts[curlib].begin(), kept_counts[curlib].end(), coptr+curlib*ncombos);
+		}
+
+        // Setting up output for the counts and size of each neighbourhood.
         SET_VECTOR_ELT(output, 3, allocVector(VECSXP, nmodes));
         SEXP count_out=VECTOR_ELT(output, 3); 
-        std::deque<std::deque<int*> > noptrs(nmodes);
+        SET_VECTOR_ELT(output, 4, allocVector(VECSXP, nmodes));
+        SEXP n_out=VECTOR_ELT(output, 4); 
         for (mode=0; mode<nmodes; ++mode) {
             SET_VECTOR_ELT(count_out, mode, allocMatrix(INTSXP, ncombos, nlibs));
-            noptrs[mode].resize(nlibs);
-            for (curlib=0; curlib<nlibs; ++curlib) {
-                if (curlib==0) { noptrs[mode][0]=INTEGER(VECTOR_ELT(count_out, mode)); }
-                else { noptrs[mode][curlib]=noptrs[mode][curlib-1] + ncombos; }
+            int* noptr=INTEGER(VECTOR_ELT(count_out, mode));
+            for (curlib=0; curlib<nlibs; ++curlib) { 
+                std::copy(kept_neighbors[mode][curlib].begin(), kept_neighbors[mode][curlib].end(), noptr+curlib*ncombos);
             }
+            SET_VECTOR_ELT(n_out, mode, allocVector(INTSXP, ncombos));
+            std::copy(kept_areas[mode].begin(), kept_areas[mode].end(), INTEGER(VECTOR_ELT(n_out, mode)));
         }
+	} catch (std::exception& e) { 
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+/* This computes the same statistics as count_background, but using the summed-area approach
+ * in summed_area.h. This is faster for large flanks, at the cost of memory: all bin pairs in the 
+ * chromosome pair must be collected before the row sweep, whereas count_background only holds 
+ * the bin pairs within the flank of the current anchor. Counts are stored once, with libraries 
+ * contiguous for each bin pair, and neighbourhood statistics are only computed for (and written 
+ * directly into the output for) those bin pairs that pass the filter.
+ */
 
-        // Setting up output for the neighbourhood size.
+SEXP count_background_sat(SEXP all, SEXP bin, SEXP back_width, SEXP exclude_width, SEXP filter, 
+		SEXP first_target_bin, SEXP last_target_bin, SEXP first_anchor_bin, SEXP last_anchor_bin) try {
+
+	if (!isInteger(filter) || LENGTH(filter)!=1) { throw std::runtime_error("filter value must be an integer scalar"); }
+	const int f=asInteger(filter);
+	if (!isInteger(back_width) || LENGTH(back_width)!=1) { throw std::runtime_error("width of neighborhood regions must be an integer scalar"); }
+	const int bwidth=asInteger(back_width);
+	if (!isInteger(exclude_width) || LENGTH(exclude_width)!=1) { throw std::runtime_error("exclusion width must be an integer scalar"); }
+	const int xwidth=asInteger(exclude_width);
+
+	// Getting the indices of the first and last bin on the target and anchor chromosomes.
+	if (!isInteger(first_target_bin) || LENGTH(first_target_bin)!=1) { throw std::runtime_error("index of first bin on target chromosome must be an integer scalar"); }
+	const int ftbin=asInteger(first_target_bin);
+	if (!isInteger(last_target_bin) || LENGTH(last_target_bin)!=1) { throw std::runtime_error("index of last bin on target chromosome must be an integer scalar"); }
+	const int ltbin=asInteger(last_target_bin);
+	if (!isInteger(first_anchor_bin) || LENGTH(first_anchor_bin)!=1) { throw std::runtime_error("index of first bin on anchor chromosome must be an integer scalar"); }
+	const int fabin=asInteger(first_anchor_bin);
+	if (!isInteger(last_anchor_bin) || LENGTH(last_anchor_bin)!=1) { throw std::runtime_error("index of last bin on anchor chromosome must be an integer scalar"); }
+	const int labin=asInteger(last_anchor_bin);
+	const bool intra=(fabin==ftbin);
+	const int ntbins=ltbin-ftbin+1, nabins=labin-fabin+1;
+	summed_area neighbors(bwidth, xwidth, nabins, ntbins, intra);
+
+	// Collecting all bin pairs with non-zero counts.
+	binner engine(all, bin, ftbin, ltbin);
+	const int nlibs=engine.get_nlibs();
+	std::vector<int> anchors, targets, counts;
+	while (!engine.empty()) {
+		engine.fill();
+		const int curanchor=engine.get_anchor() - fabin;
+        const std::vector<int>& waschanged=engine.get_changed();
+        const std::vector<int>& curcounts=engine.get_counts();
+		for (size_t w=0; w<waschanged.size(); ++w) {
+			anchors.push_back(curanchor);
+			targets.push_back(waschanged[w]);
+		}
+		counts.insert(counts.end(), curcounts.begin(), curcounts.end());
+	}
+
+	// Only reporting those bin pairs above the filter.
+	const int npair=anchors.size();
+	const int nmodes=summed_area::nmodes;
+	std::vector<int> outdex(npair, -1);
+	int ncombos=0;
+	for (int i=0; i<npair; ++i) {
+		int countsum=0;
+		const int* curcounts=counts.data() + i*nlibs;
+		for (int lib=0; lib<nlibs; ++lib) { countsum+=curcounts[lib]; }
+		if (countsum >= f) { 
+			outdex[i]=ncombos;
+			++ncombos;
+		}
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 5));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(INTSXP, ncombos));
+		int* aoptr=INTEGER(VECTOR_ELT(output, 0));
+		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, ncombos));
+		int* toptr=INTEGER(VECTOR_ELT(output, 1));
+		SET_VECTOR_ELT(output, 2, allocMatrix(INTSXP, ncombos, nlibs));
+		int* coptr=INTEGER(VECTOR_ELT(output, 2));
+        SET_VECTOR_ELT(output, 3, allocVector(VECSXP, nmodes));
+        SEXP count_out=VECTOR_ELT(output, 3); 
         SET_VECTOR_ELT(output, 4, allocVector(VECSXP, nmodes));
         SEXP n_out=VECTOR_ELT(output, 4); 
-        std::deque<int*> nnptrs(nmodes);
-        for (mode=0; mode<nmodes; ++mode) {
+        std::vector<int*> noptrs(nmodes), nnptrs(nmodes);
+        for (int mode=0; mode<nmodes; ++mode) {
+            SET_VECTOR_ELT(count_out, mode, allocMatrix(INTSXP, ncombos, nlibs));
+            noptrs[mode]=INTEGER(VECTOR_ELT(count_out, mode));
+            std::fill(noptrs[mode], noptrs[mode]+ncombos*nlibs, 0);
             SET_VECTOR_ELT(n_out, mode, allocVector(INTSXP, ncombos));
             nnptrs[mode]=INTEGER(VECTOR_ELT(n_out, mode));
-        }
-		
-        // Filling in empty info for inter-chromosomal interactions.
-        if (startmode!=0) {
-            for (curlib=0; curlib<nlibs; ++curlib) {
-                std::fill(noptrs[0][curlib], noptrs[0][curlib]+ncombos, 0);
-            }
-            std::fill(nnptrs[0], nnptrs[0]+ncombos, 0);
-        }
-
-		// Iterating across and filling both the matrix and the components.
-		int cdex=-1;
-		double backaverage, maxaverage;
-		for (size_t vecdex=0; vecdex<anchors.size(); ++vecdex) {
-			aoptr[vecdex]=anchors[vecdex]+fabin;
-			toptr[vecdex]=targets[vecdex]+ftbin;
-
-            for (curlib=0; curlib<nlibs; ++curlib) {
-				++cdex; 			   	
-				coptrs[curlib][vecdex]=counts[cdex]; 
-
-                for (mode=startmode; mode<nmodes; ++mode) {
-                    noptrs[mode][curlib][vecdex]=neighborcount[mode][cdex];
-                }
-			}
+            std::fill(nnptrs[mode], nnptrs[mode]+ncombos, 0);
         }
 
-        for (mode=startmode; mode<nmodes; ++mode) {
-            std::copy(neighborarea[mode].begin(), neighborarea[mode].end(), nnptrs[mode]);
+		for (int i=0; i<npair; ++i) {
+			const int& k=outdex[i];
+			if (k < 0) { continue; }
+			aoptr[k]=anchors[i]+fabin;
+			toptr[k]=targets[i]+ftbin;
+			const int* curcounts=counts.data() + i*nlibs;
+			for (int lib=0; lib<nlibs; ++lib) { coptr[lib*ncombos+k]=curcounts[lib]; }
 		}
-       
+
+		// Computing neighbourhood counts for the reported bin pairs.
+		neighbors.compute(anchors.data(), targets.data(), counts.data(), npair, nlibs, outdex.data(), ncombos, noptrs.data(), nnptrs.data());
 	} catch (std::exception& e) { 
 		UNPROTECT(1);
 		throw;
@@ -279,5 +385,3 @@ SEXP count_background(SEXP all, SEXP bin, SEXP back_width, SEXP exclude_width, S
 } catch (std::exception& e) {
 	return mkString(e.what());
 }
-
-
@@ -0,0 +1,78 @@
+#include "read_count.h"
+#include "interval_index.h"
+
+/* This counts the number of read pairs in each box of the interaction space, for all 
+ * libraries in a single chromosome pair. Each read pair is represented as a point 
+ * (i.e., fragment indices or 5' positions), and boxes are supplied as entries of 
+ * a box index with the corresponding box ID. A box may be represented by multiple 
+ * entries (e.g., when reflected around the diagonal), but each read pair is only
+ * counted once per box. Read pairs are sorted, so the hits for identical points are 
+ * re-used rather than being queried again.
+ */
+
+SEXP count_boxes(SEXP all, SEXP entries, SEXP entry_ids, SEXP nboxes) try {
+	if (!isNewList(entries) || LENGTH(entries)!=6) { throw std::runtime_error("box entries should be a list of length 6"); }
+	std::vector<const int*> eptrs(6);
+	int nentries=0;
+	for (int i=0; i<6; ++i) {
+		SEXP current=VECTOR_ELT(entries, i);
+		if (!isInteger(current)) { throw std::runtime_error("box coordinates should be integer vectors"); }
+		if (i==0) {
+			nentries=LENGTH(current);
+		} else if (LENGTH(current)!=nentries) {
+			throw std::runtime_error("box coordinate vectors should be of the same length");
+		}
+		eptrs[i]=INTEGER(current);
+	}
+	if (!isInteger(entry_ids) || LENGTH(entry_ids)!=nentries) { throw std::runtime_error("box IDs should be an integer vector of length equal to the number of entries"); }
+	const int* iptr=INTEGER(entry_ids);
+	if (!isInteger(nboxes) || LENGTH(nboxes)!=1) { throw std::runtime_error("number of boxes should be an integer scalar"); }
+	const int nb=asInteger(nboxes);
+	for (int e=0; e<nentries; ++e) {
+		if (iptr[e] < 1 || iptr[e] > nb) { throw std::runtime_error("box IDs should be positive integers no greater than the number of boxes"); }
+	}
+	const box_index index(nentries, eptrs[0], eptrs[1], eptrs[2], eptrs[3], eptrs[4], eptrs[5]);
+
+	if (!isNewList(all)) { throw std::runtime_error("data on interacting PETs must be contained within a list"); }
+	const int nlibs=LENGTH(all);
+	std::deque<const int*> aptrs, tptrs;
+	std::deque<int> nums, indices;
+	setup_pair_data(all, nlibs, aptrs, tptrs, nums, indices);
+
+	SEXP output=PROTECT(allocMatrix(INTSXP, nb, nlibs));
+	try {
+		int* optr=INTEGER(output);
+		std::fill(optr, optr+nb*nlibs, 0);
+		std::vector<int> hits, boxes, last_seen(nb, -1);
+		int counter=0;
+
+		for (int lib=0; lib<nlibs; ++lib) {
+			int* curout=optr + lib*nb;
+			const int* a=aptrs[lib], * t=tptrs[lib];
+			for (int i=0; i<nums[lib]; ++i) {
+				if (i==0 || a[i]!=a[i-1] || t[i]!=t[i-1]) {
+					// Identifying the unique boxes containing the current point.
+					index.overlaps(1, a[i], a[i], 1, t[i], t[i], false, hits);
+					boxes.clear();
+					++counter;
+					for (size_t h=0; h<hits.size(); ++h) {
+						const int curbox=iptr[hits[h]]-1;
+						if (last_seen[curbox]!=counter) {
+							last_seen[curbox]=counter;
+							boxes.push_back(curbox);
+						}
+					}
+				}
+				for (size_t b=0; b<boxes.size(); ++b) { ++curout[boxes[b]]; }
+			}
+		}
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
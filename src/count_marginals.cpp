@@ -0,0 +1,70 @@
+#include "read_count.h"
+
+/* This computes the marginal counts for all bins on the anchor1 and anchor2 chromosomes,
+ * for all libraries in a single pass over the read pairs. It also returns the total
+ * number of read pairs in each library, which avoids a separate pass to get the totals.
+ */
+
+SEXP count_marginals(SEXP all, SEXP bin, SEXP firstanchor, SEXP lastanchor, SEXP firsttarget, SEXP lasttarget) try {
+	if (!isInteger(bin)) { throw std::runtime_error("anchor bin indices must be integer vectors"); }
+	const int* bptr=INTEGER(bin)-1; // Assuming 1-based indices for anchors and targets.
+	const int nfrags=LENGTH(bin);
+
+	if (!isInteger(firstanchor) || LENGTH(firstanchor)!=1) { throw std::runtime_error("index of first bin on anchor1 chromosome must be an integer scalar"); }
+	const int fabin=asInteger(firstanchor);
+	if (!isInteger(lastanchor) || LENGTH(lastanchor)!=1) { throw std::runtime_error("index of last bin on anchor1 chromosome must be an integer scalar"); }
+	const int labin=asInteger(lastanchor);
+	if (!isInteger(firsttarget) || LENGTH(firsttarget)!=1) { throw std::runtime_error("index of first bin on anchor2 chromosome must be an integer scalar"); }
+	const int ftbin=asInteger(firsttarget);
+	if (!isInteger(lasttarget) || LENGTH(lasttarget)!=1) { throw std::runtime_error("index of last bin on anchor2 chromosome must be an integer scalar"); }
+	const int ltbin=asInteger(lasttarget);
+	const int nabins=labin-fabin+1, ntbins=ltbin-ftbin+1;
+	if (nabins <= 0 || ntbins <= 0) { throw std::runtime_error("number of bins must be positive"); }
+
+	if (!isNewList(all)) { throw std::runtime_error("data on interacting read pairs must be contained within a list"); }
+	const int nlibs=LENGTH(all);
+	std::deque<const int*> aptrs, tptrs;
+	std::deque<int> nums, indices;
+	setup_pair_data(all, nlibs, aptrs, tptrs, nums, indices);
+
+	SEXP output=PROTECT(allocVector(VECSXP, 3));
+try {
+	SET_VECTOR_ELT(output, 0, allocMatrix(INTSXP, nabins, nlibs));
+	int* amptr=INTEGER(VECTOR_ELT(output, 0));
+	std::fill(amptr, amptr+nabins*nlibs, 0);
+	SET_VECTOR_ELT(output, 1, allocMatrix(INTSXP, ntbins, nlibs));
+	int* tmptr=INTEGER(VECTOR_ELT(output, 1));
+	std::fill(tmptr, tmptr+ntbins*nlibs, 0);
+	SET_VECTOR_ELT(output, 2, allocVector(INTSXP, nlibs));
+	int* totptr=INTEGER(VECTOR_ELT(output, 2));
+
+	// Each library is handled separately, and fills its own column of each matrix.
+	for (int lib=0; lib<nlibs; ++lib) {
+		const int* aptr=aptrs[lib];
+		const int* tptr=tptrs[lib];
+		int* curam=amptr+lib*nabins;
+		int* curtm=tmptr+lib*ntbins;
+		const int& num=nums[lib];
+
+		for (int i=0; i<num; ++i) {
+			const int& curf1=aptr[i];
+			const int& curf2=tptr[i];
+			if (curf1 < 1 || curf1 > nfrags || curf2 < 1 || curf2 > nfrags) { throw std::runtime_error("fragment index out of range"); }
+			const int curab=bptr[curf1]-fabin;
+			const int curtb=bptr[curf2]-ftbin;
+			if (curab < 0 || curab >= nabins) { throw std::runtime_error("anchor1 bin index outside of chromosome range"); }
+			if (curtb < 0 || curtb >= ntbins) { throw std::runtime_error("anchor2 bin index outside of chromosome range"); }
+			++curam[curab];
+			++curtm[curtb];
+		}
+		totptr[lib]=num;
+	}
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
@@ -1,8 +1,10 @@
 #include "read_count.h"
 
-SEXP count_patch(SEXP all, SEXP bin, SEXP filter, SEXP firstbin, SEXP lastbin) try {
+SEXP count_patch(SEXP all, SEXP bin, SEXP filter, SEXP firstbin, SEXP lastbin, SEXP sparse) try {
 	if (!isInteger(filter) || LENGTH(filter)!=1) { throw std::runtime_error("filter value must be an integer scalar"); }
 	const int f=asInteger(filter);
+	if (!isLogical(sparse) || LENGTH(sparse)!=1) { throw std::runtime_error("sparse specifier must be a logical scalar"); }
+	const bool as_sparse=asLogical(sparse);
 
 	// Getting the indices of the first and last bin on the target chromosome.
 	if (!isInteger(firstbin) || LENGTH(firstbin)!=1) { throw std::runtime_error("index of first bin on target chromosome must be an integer scalar"); }
@@ -16,32 +18,46 @@ SEXP count_patch(SEXP all, SEXP bin, SEXP filter, SEXP firstbin, SEXP lastbin) t
 
 	// Sundries.
 	std::deque<int> counts, anchors, targets;
-	int rowdex, countsum, curlib, curanchor;
-    std::deque<int>::const_iterator ccIt, wcIt;
+
+	/* For sparse output, non-zero counts are stored directly in a column-wise manner, i.e., 
+	 * separately for each library. This avoids holding the zeroes in 'counts'.
+	 */
+	std::deque<std::deque<int> > nonzero_rows(as_sparse ? nlibs : 0), nonzero_counts(as_sparse ? nlibs : 0);
+	int countsum, curlib, curanchor;
+    std::vector<int>::const_iterator ccIt, wcIt;
 
 	// Running through all libraries.
 	while (!engine.empty()) {
 		engine.fill();
 		curanchor=engine.get_anchor();
-        const std::deque<int>& waschanged=engine.get_changed();
-        const std::deque<int>& curcounts=engine.get_counts();
+        const std::vector<int>& waschanged=engine.get_changed();
+        const std::vector<int>& curcounts=engine.get_counts();
 
 		// Adding it to the main list, if it's large enough.
+        ccIt=curcounts.begin();
         for (wcIt=waschanged.begin(); wcIt!=waschanged.end(); ++wcIt) {
-			rowdex=(*wcIt)*nlibs;
-            ccIt=curcounts.begin()+rowdex;
 			countsum=0;
 			for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
                 countsum+=*ccIt;
             }
 
 			if (countsum >= f) { 
-				anchors.push_back(curanchor);
-				targets.push_back((*wcIt) + fbin);
                 ccIt-=nlibs;
-				for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
-                    counts.push_back(*ccIt);
+                if (as_sparse) {
+                    const int currow=anchors.size();
+                    for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
+                        if (*ccIt) { 
+                            nonzero_rows[curlib].push_back(currow);
+                            nonzero_counts[curlib].push_back(*ccIt);
+                        }
+                    }
+                } else {
+                    for (curlib=0; curlib<nlibs; ++curlib, ++ccIt) { 
+                        counts.push_back(*ccIt);
+                    }
                 }
+				anchors.push_back(curanchor);
+				targets.push_back((*wcIt) + fbin);
 			}
 		}
 	}
@@ -53,19 +69,109 @@ SEXP count_patch(SEXP all, SEXP bin, SEXP filter, SEXP firstbin, SEXP lastbin) t
 		int* aoptr=INTEGER(VECTOR_ELT(output, 0));
 		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, ncombos));
 		int* toptr=INTEGER(VECTOR_ELT(output, 1));
-		SET_VECTOR_ELT(output, 2, allocMatrix(INTSXP, ncombos, nlibs));
-		std::deque<int*> coptrs(nlibs);
-		for (curlib=0; curlib<nlibs; ++curlib) {
-			if (curlib==0) { coptrs[curlib]=INTEGER(VECTOR_ELT(output, 2)); }
-			else { coptrs[curlib]=coptrs[curlib-1]+ncombos; }
-		}	
+		std::copy(anchors.begin(), anchors.end(), aoptr);
+		std::copy(targets.begin(), targets.end(), toptr);
+
+		if (as_sparse) {
+			/* Returning column pointers, 0-based row indices and non-zero counts for each library, 
+			 * i.e., the components of a compressed sparse column matrix.
+			 */
+			SET_VECTOR_ELT(output, 2, allocVector(VECSXP, 3));
+			SEXP sparse_out=VECTOR_ELT(output, 2);
+			SET_VECTOR_ELT(sparse_out, 0, allocVector(INTSXP, nlibs+1));
+			int* poptr=INTEGER(VECTOR_ELT(sparse_out, 0));
+			poptr[0]=0;
+			for (curlib=0; curlib<nlibs; ++curlib) { poptr[curlib+1]=poptr[curlib]+nonzero_rows[curlib].size(); }
+			SET_VECTOR_ELT(sparse_out, 1, allocVector(INTSXP, poptr[nlibs]));
+			int* ioptr=INTEGER(VECTOR_ELT(sparse_out, 1));
+			SET_VECTOR_ELT(sparse_out, 2, allocVector(INTSXP, poptr[nlibs]));
+			int* xoptr=INTEGER(VECTOR_ELT(sparse_out, 2));
+
+			for (curlib=0; curlib<nlibs; ++curlib) {
+				ioptr=std::copy(nonzero_rows[curlib].begin(), nonzero_rows[curlib].end(), ioptr);
+				xoptr=std::copy(nonzero_counts[curlib].begin(), nonzero_counts[curlib].end(), xoptr);
+			}
+		} else {
+			SET_VECTOR_ELT(output, 2, allocMatrix(INTSXP, ncombos, nlibs));
+			std::deque<int*> coptrs(nlibs);
+			for (curlib=0; curlib<nlibs; ++curlib) {
+				if (curlib==0) { coptrs[curlib]=INTEGER(VECTOR_ELT(output, 2)); }
+				else { coptrs[curlib]=coptrs[curlib-1]+ncombos; }
+			}	
 		
-		// Iterating across and filling both the matrix and the components.
-		int cdex=-1;
-		for (size_t vecdex=0; vecdex<anchors.size(); ++vecdex) {
-			aoptr[vecdex]=anchors[vecdex];
-			toptr[vecdex]=targets[vecdex];
-			for (curlib=0; curlib<nlibs; ++curlib) { coptrs[curlib][vecdex]=counts[++cdex]; }
+			// Iterating across and filling the matrix.
+			int cdex=-1;
+			for (int vecdex=0; vecdex<ncombos; ++vecdex) {
+				for (curlib=0; curlib<nlibs; ++curlib) { coptrs[curlib][vecdex]=counts[++cdex]; }
+			}
+		}
+	} catch (std::exception& e) { 
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+/* This combines the compressed sparse column components from each call to count_patch, where 
+ * the bin pairs from successive calls are stacked on top of each other. Components are filled
+ * column-wise, to avoid forming and sorting triplets for the entire matrix.
+ */
+
+SEXP combine_sparse(SEXP chunks, SEXP nrows, SEXP ncols) try {
+	if (!isNewList(chunks)) { throw std::runtime_error("sparse components must be supplied in a list"); }
+	const int nchunks=LENGTH(chunks);
+	if (!isInteger(nrows) || LENGTH(nrows)!=nchunks) { throw std::runtime_error("number of rows must be an integer vector of length equal to the number of chunks"); }
+	const int* nrptr=INTEGER(nrows);
+	if (!isInteger(ncols) || LENGTH(ncols)!=1 || asInteger(ncols) < 0) { throw std::runtime_error("number of columns must be a non-negative integer scalar"); }
+	const int nlibs=asInteger(ncols);
+
+	std::deque<const int*> pptrs(nchunks), iptrs(nchunks), xptrs(nchunks);
+	std::deque<int> row_offsets(nchunks);
+	double total_rows=0, total_nonzero=0;
+	for (int c=0; c<nchunks; ++c) {
+		SEXP current=VECTOR_ELT(chunks, c);
+		if (!isNewList(current) || LENGTH(current)!=3) { throw std::runtime_error("sparse components for each chunk must be a list of length 3"); }
+		SEXP curp=VECTOR_ELT(current, 0), curi=VECTOR_ELT(current, 1), curx=VECTOR_ELT(current, 2);
+		if (!isInteger(curp) || LENGTH(curp)!=nlibs+1) { throw std::runtime_error("column pointers should be an integer vector of length equal to the number of columns plus 1"); }
+		pptrs[c]=INTEGER(curp);
+		const int nnzero=pptrs[c][nlibs];
+		if (!isInteger(curi) || !isInteger(curx) || LENGTH(curi)!=nnzero || LENGTH(curx)!=nnzero) { 
+			throw std::runtime_error("row indices and values should be integer vectors of length equal to the number of non-zero entries"); }
+		iptrs[c]=INTEGER(curi);
+		xptrs[c]=INTEGER(curx);
+
+		row_offsets[c]=total_rows;
+		total_rows+=nrptr[c];
+		total_nonzero+=nnzero;
+		if (total_rows > INT_MAX || total_nonzero > INT_MAX) { throw std::runtime_error("too many bin pairs for sparse count storage"); }
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 3));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(INTSXP, nlibs+1));
+		int* poptr=INTEGER(VECTOR_ELT(output, 0));
+		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, total_nonzero));
+		int* ioptr=INTEGER(VECTOR_ELT(output, 1));
+		SET_VECTOR_ELT(output, 2, allocVector(REALSXP, total_nonzero));
+		double* xoptr=REAL(VECTOR_ELT(output, 2));
+
+		poptr[0]=0;
+		for (int lib=0; lib<nlibs; ++lib) {
+			int& curp=(poptr[lib+1]=poptr[lib]);
+			for (int c=0; c<nchunks; ++c) {
+				const int& offset=row_offsets[c];
+				const int* cpptr=pptrs[c];
+				for (int nzdex=cpptr[lib]; nzdex<cpptr[lib+1]; ++nzdex, ++curp) {
+					const int& currow=iptrs[c][nzdex];
+					if (currow < 0 || currow >= nrptr[c]) { throw std::runtime_error("row indices out of range for sparse components"); }
+					ioptr[curp]=currow + offset;
+					xoptr[curp]=xptrs[c][nzdex];
+				}
+			}
 		}
 	} catch (std::exception& e) { 
 		UNPROTECT(1);
@@ -2,6 +2,7 @@
 #define HICCUP_H
 
 #include <deque>
+#include <vector>
 #include <queue>
 #include <map>
 #include <set>
@@ -9,6 +10,7 @@
 #include <sstream>
 #include <algorithm>
 #include <cmath>
+#include <climits>
 
 #include "R.h"
 #include "Rinternals.h"
@@ -26,9 +28,7 @@ private:
 
 extern "C" {
 
-SEXP check_input(SEXP, SEXP);
-
-SEXP cap_input(SEXP, SEXP, SEXP);
+SEXP process_pairs(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 
 SEXP cluster_2d (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP); 
@@ -37,23 +37,57 @@ SEXP split_clusters (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 SEXP get_bounding_box (SEXP, SEXP, SEXP);
 
+SEXP cluster_pairs (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP interval_overlaps (SEXP, SEXP, SEXP);
+
+SEXP merge_parents (SEXP, SEXP);
+
 SEXP quadrant_bg (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
+SEXP quadrant_sat (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP kernel_bg (SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP lambda_chunk_test(SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP neighbor_decay(SEXP, SEXP, SEXP, SEXP, SEXP);
+
 
 SEXP count_background(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP); 
 
+SEXP count_background_sat(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP); 
+
 SEXP count_connect(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 SEXP count_reconnect(SEXP, SEXP);
 
-SEXP count_patch(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP count_patch(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP combine_sparse(SEXP, SEXP, SEXP);
+
+SEXP count_boxes(SEXP, SEXP, SEXP, SEXP);
+
+SEXP count_marginals(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 SEXP directionality(SEXP, SEXP, SEXP, SEXP, SEXP);
 
+SEXP domain_signals(SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP call_domains(SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP compartment_scores(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP cnv_grid_offsets(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+
+SEXP iterative_correction(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+
+SEXP stream_correction(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
-SEXP iterative_correction(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP get_missing_dist(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
-SEXP get_missing_dist(SEXP, SEXP, SEXP, SEXP);
+SEXP bin_trend_points(SEXP, SEXP, SEXP, SEXP);
 
 
 SEXP report_hic_pairs(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP); 
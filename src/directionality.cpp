@@ -45,13 +45,13 @@ try {
 	double current_average;
    	size_t diff;
     int lib;
-    std::deque<int>::const_iterator ccIt, wcIt;
+    std::vector<int>::const_iterator ccIt, wcIt;
 
 	while (!engine.empty()) {
 		engine.fill();
 		curanchor=engine.get_anchor() - fbin;
-        const std::deque<int>& waschanged=engine.get_changed();
-        const std::deque<int>& curcounts=engine.get_counts();
+        const std::vector<int>& waschanged=engine.get_changed();
+        const std::vector<int>& curcounts=engine.get_counts();
 
         for (wcIt=waschanged.begin(); wcIt!=waschanged.end(); ++wcIt) {
        	    rowdex=(*wcIt);
@@ -59,7 +59,7 @@ try {
 
 			// Filling up the directionality indices.		
 			if (diff && diff <= sp) { 
-                ccIt=curcounts.begin() + rowdex*nlibs;
+                ccIt=curcounts.begin() + (wcIt - waschanged.begin())*nlibs;
                 for (lib=0; lib<nlibs; ++lib, ++ccIt) {
                     const int& thiscount=(*ccIt);
                     downptrs[lib][curanchor]+=thiscount;
@@ -0,0 +1,154 @@
+#include "read_count.h"
+
+/* This computes several domain-level statistics for all bins on a chromosome, for multiple spans
+ * in a single pass through the read pairs. For each bin, counts to upstream and downstream bins
+ * are accumulated by distance up to the largest span; cumulative sums of these profiles then yield
+ * the up/down counts (and the directionality index) for any span. The insulation score of each bin
+ * is the count in the square window between the 'span' bins on either side, which is accumulated
+ * with a difference array along the chromosome. Boundary strength is defined from the insulation
+ * scores, as the log-fold change of the average score in the flanking windows over that of the bin.
+ */
+
+SEXP domain_signals(SEXP all, SEXP bin, SEXP spans, SEXP first_bin, SEXP last_bin) try {
+	if (!isInteger(spans)) { throw std::runtime_error("spans must be an integer vector"); }
+	const int nspans=LENGTH(spans);
+	const int* sptr=INTEGER(spans);
+	int maxspan=0;
+	for (int s=0; s<nspans; ++s) {
+		if (sptr[s]==NA_INTEGER || sptr[s] < 1) { throw std::runtime_error("spans must be positive integers"); }
+		if (sptr[s] > maxspan) { maxspan=sptr[s]; }
+	}
+
+	// Getting the indices of the first and last bin on the chromosome.
+	if (!isInteger(first_bin) || LENGTH(first_bin)!=1) { throw std::runtime_error("index of first bin must be an integer scalar"); }
+	const int fbin=asInteger(first_bin);
+	if (!isInteger(last_bin) || LENGTH(last_bin)!=1) { throw std::runtime_error("index of last bin must be an integer scalar"); }
+	const int lbin=asInteger(last_bin);
+
+	// Setting up the binning engine.
+	binner engine(all, bin, fbin, lbin);
+	const int nlibs=engine.get_nlibs();
+	const int nbins=engine.get_nbins();
+
+	// Profiles of counts by distance for each bin and library, and difference arrays for the insulation windows.
+	const size_t profwidth=size_t(maxspan)*nlibs;
+	std::vector<int> downprof(profwidth*nbins), upprof(profwidth*nbins);
+	std::vector<std::vector<double> > insdiff(nspans, std::vector<double>(size_t(nbins+1)*nlibs));
+
+	while (!engine.empty()) {
+		engine.fill();
+		const int curanchor=engine.get_anchor() - fbin;
+		const std::vector<int>& waschanged=engine.get_changed();
+		const std::vector<int>& curcounts=engine.get_counts();
+
+		for (size_t w=0; w<waschanged.size(); ++w) {
+			const int& curtarget=waschanged[w];
+			const int diff=curanchor-curtarget;
+			if (!diff) { continue; }
+			const int* ccptr=&(curcounts[w*nlibs]);
+
+			if (diff <= maxspan) {
+				int* dptr=&(downprof[size_t(curanchor)*profwidth + size_t(diff-1)*nlibs]);
+				int* uptr=&(upprof[size_t(curtarget)*profwidth + size_t(diff-1)*nlibs]);
+				for (int lib=0; lib<nlibs; ++lib) {
+					dptr[lib]+=ccptr[lib];
+					uptr[lib]+=ccptr[lib];
+				}
+			}
+
+			// Adding to the windows of all bins between the target and anchor, within 'span' of both.
+			for (int s=0; s<nspans; ++s) {
+				const int& sp=sptr[s];
+				if ((diff+1)/2 > sp) { continue; }
+				const int lower=std::max(curtarget+1, curanchor-sp), upper=std::min(curanchor-1, curtarget+sp);
+				if (lower > upper) { continue; }
+				double* startptr=&(insdiff[s][size_t(lower)*nlibs]);
+				double* endptr=&(insdiff[s][size_t(upper+1)*nlibs]);
+				for (int lib=0; lib<nlibs; ++lib) {
+					startptr[lib]+=ccptr[lib];
+					endptr[lib]-=ccptr[lib];
+				}
+			}
+		}
+	}
+
+	// Converting the profiles into cumulative counts with increasing distance.
+	for (int b=0; b<nbins; ++b) {
+		for (int d=1; d<maxspan; ++d) {
+			const size_t prev=size_t(b)*profwidth + size_t(d-1)*nlibs, cur=prev+nlibs;
+			for (int lib=0; lib<nlibs; ++lib) {
+				downprof[cur+lib]+=downprof[prev+lib];
+				upprof[cur+lib]+=upprof[prev+lib];
+			}
+		}
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 5));
+try {
+	for (int i=0; i<5; ++i) { SET_VECTOR_ELT(output, i, allocVector(VECSXP, nspans)); }
+	std::vector<double> runsum(nlibs);
+
+	for (int s=0; s<nspans; ++s) {
+		const int& sp=sptr[s];
+		SET_VECTOR_ELT(VECTOR_ELT(output, 0), s, allocMatrix(INTSXP, nbins, nlibs));
+		int* upptr=INTEGER(VECTOR_ELT(VECTOR_ELT(output, 0), s));
+		SET_VECTOR_ELT(VECTOR_ELT(output, 1), s, allocMatrix(INTSXP, nbins, nlibs));
+		int* downptr=INTEGER(VECTOR_ELT(VECTOR_ELT(output, 1), s));
+		SET_VECTOR_ELT(VECTOR_ELT(output, 2), s, allocMatrix(REALSXP, nbins, nlibs));
+		double* dirptr=REAL(VECTOR_ELT(VECTOR_ELT(output, 2), s));
+		SET_VECTOR_ELT(VECTOR_ELT(output, 3), s, allocMatrix(REALSXP, nbins, nlibs));
+		double* insptr=REAL(VECTOR_ELT(VECTOR_ELT(output, 3), s));
+		SET_VECTOR_ELT(VECTOR_ELT(output, 4), s, allocMatrix(REALSXP, nbins, nlibs));
+		double* boundptr=REAL(VECTOR_ELT(VECTOR_ELT(output, 4), s));
+
+		// Up/down counts and the directionality index of Dixon et al. (2012).
+		const size_t offset=size_t(sp-1)*nlibs;
+		for (int b=0; b<nbins; ++b) {
+			for (int lib=0; lib<nlibs; ++lib) {
+				const size_t outdex=size_t(lib)*nbins+b;
+				const int& up=(upptr[outdex]=upprof[size_t(b)*profwidth + offset + lib]);
+				const int& down=(downptr[outdex]=downprof[size_t(b)*profwidth + offset + lib]);
+				if (up==down) {
+					dirptr[outdex]=0;
+				} else {
+					const double delta=double(up)-double(down);
+					dirptr[outdex]=(delta > 0 ? 1 : -1) * delta * delta / (double(up)+double(down));
+				}
+			}
+		}
+
+		// Insulation scores, which are undefined if the window extends past the ends of the chromosome.
+		std::fill(runsum.begin(), runsum.end(), 0);
+		for (int b=0; b<nbins; ++b) {
+			const bool incomplete=(b < sp || b + sp >= nbins);
+			for (int lib=0; lib<nlibs; ++lib) {
+				runsum[lib]+=insdiff[s][size_t(b)*nlibs+lib];
+				insptr[size_t(lib)*nbins+b]=(incomplete ? R_NaReal : runsum[lib]);
+			}
+		}
+
+		// Boundary strength, using the average insulation scores for the 'span' bins on either side.
+		for (int lib=0; lib<nlibs; ++lib) {
+			const double* curins=insptr+size_t(lib)*nbins;
+			double* curbound=boundptr+size_t(lib)*nbins;
+			for (int b=0; b<nbins; ++b) {
+				if (b < 2*sp || b + 2*sp >= nbins) {
+					curbound[b]=R_NaReal;
+					continue;
+				}
+				double flank=0;
+				for (int f=1; f<=sp; ++f) { flank+=curins[b-f]+curins[b+f]; }
+				flank/=2*sp;
+				curbound[b]=std::log((flank+1)/(curins[b]+1))/std::log(2.0);
+			}
+		}
+	}
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
@@ -7,22 +7,38 @@
 extern "C" { 
 
 static const R_CallMethodDef all_call_entries[] = {
-	CALLDEF(check_input, 2),
-	CALLDEF(cap_input, 3),
+	CALLDEF(process_pairs, 13),
 	
     CALLDEF(cluster_2d, 6),
 	CALLDEF(split_clusters, 6),
 	CALLDEF(get_bounding_box, 3),
+	CALLDEF(cluster_pairs, 8),
+	CALLDEF(interval_overlaps, 3),
+	CALLDEF(merge_parents, 2),
     CALLDEF(quadrant_bg, 8),
+    CALLDEF(quadrant_sat, 8),
+    CALLDEF(kernel_bg, 7),
+    CALLDEF(lambda_chunk_test, 5),
+    CALLDEF(neighbor_decay, 5),
 
 	CALLDEF(count_background, 9),
+	CALLDEF(count_background_sat, 9),
 	CALLDEF(count_connect, 8),
 	CALLDEF(count_reconnect, 2),
-	CALLDEF(count_patch, 5),
+	CALLDEF(count_patch, 6),
+	CALLDEF(combine_sparse, 3),
+	CALLDEF(count_boxes, 4),
+	CALLDEF(count_marginals, 6),
     CALLDEF(directionality, 5),
+    CALLDEF(domain_signals, 5),
+    CALLDEF(call_domains, 5),
+    CALLDEF(compartment_scores, 8),
+    CALLDEF(cnv_grid_offsets, 7),
 	
-    CALLDEF(iterative_correction, 9),
-    CALLDEF(get_missing_dist, 4),
+    CALLDEF(iterative_correction, 12),
+    CALLDEF(stream_correction, 7),
+    CALLDEF(get_missing_dist, 6),
+    CALLDEF(bin_trend_points, 4),
 	
     CALLDEF(report_hic_pairs, 10),
 	CALLDEF(report_hic_binned_pairs, 9),
@@ -0,0 +1,106 @@
+#include "interval_index.h"
+
+interval_index::interval_index(int n, const int* chr, const int* start, const int* end) : nintervals(n) {
+	int maxchr=0;
+	for (int i=0; i<n; ++i) {
+		if (chr[i]==NA_INTEGER || chr[i] <= 0) { throw std::runtime_error("chromosome codes should be positive integers"); }
+		if (chr[i] > maxchr) { maxchr=chr[i]; }
+	}
+
+	// Building a tree for each chromosome, where chromosome 'c' is stored in trees[c-1].
+	std::vector<std::vector<int> > by_chr(maxchr);
+	for (int i=0; i<n; ++i) { by_chr[chr[i]-1].push_back(i); }
+	trees.reserve(maxchr);
+	for (int c=0; c<maxchr; ++c) { trees.push_back(interval_tree(by_chr[c], start, end)); }
+	return;
+}
+
+void interval_index::overlaps(int c, int qstart, int qend, bool within, std::vector<int>& hits) const {
+	hits.clear();
+	if (c <= 0 || c > int(trees.size())) { return; }
+
+	/* Any overlapping interval must start at or before the query end, and end at or after the query start. 
+	 * For containment, it must start at or before the query start, and end at or after the query end.
+	 */
+	const int limit=(within ? qstart : qend);
+	const int threshold=(within ? qend : qstart);
+	trees[c-1].query(limit, threshold, hits);
+	std::sort(hits.begin(), hits.end());
+	return;
+}
+
+box_index::box_index(int n, const int* fchr, const int* fstart, const int* fend, const int* sc, const int* ss, const int* se) :
+		first(n, fchr, fstart, fend), schr(sc), sstart(ss), send(se) {}
+
+void box_index::overlaps(int fc, int fs, int fe, int sc, int ss, int se, bool within, std::vector<int>& hits) const {
+	first.overlaps(fc, fs, fe, within, candidates);
+	hits.clear();
+	for (size_t i=0; i<candidates.size(); ++i) {
+		const int& cand=candidates[i];
+		if (schr[cand]!=sc) { continue; }
+		if (within ? (sstart[cand] <= ss && send[cand] >= se) : (sstart[cand] <= se && send[cand] >= ss)) {
+			hits.push_back(cand);
+		}
+	}
+	return;
+}
+
+/* These functions identify overlaps between a set of query intervals and the indexed
+ * subject intervals. Intervals are supplied as lists of integer vectors 
+ * containing the chromosome codes, start and end positions. Hits are returned as 1-based 
+ * query and subject indices, sorted by query and then by subject.
+ */
+
+std::vector<const int*> check_intervals(SEXP intervals, int nvec, int& n, const char* msg) {
+	if (!isNewList(intervals) || LENGTH(intervals)!=nvec) { throw std::runtime_error(msg); }
+	std::vector<const int*> output(nvec);
+	for (int i=0; i<nvec; ++i) {
+		SEXP current=VECTOR_ELT(intervals, i);
+		if (!isInteger(current)) { throw std::runtime_error("interval coordinates should be integer vectors"); }
+		if (i==0) { 
+			n=LENGTH(current); 
+		} else if (LENGTH(current)!=n) { 
+			throw std::runtime_error("interval coordinate vectors should be of the same length"); 
+		}
+		output[i]=INTEGER(current);
+	}
+	return output;
+}
+
+SEXP save_hits(const std::deque<int>& qhits, const std::deque<int>& shits) {
+	const int nhits=qhits.size();
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(INTSXP, nhits));
+		std::copy(qhits.begin(), qhits.end(), INTEGER(VECTOR_ELT(output, 0)));
+		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, nhits));
+		std::copy(shits.begin(), shits.end(), INTEGER(VECTOR_ELT(output, 1)));
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+	UNPROTECT(1);
+	return output;
+}
+
+SEXP interval_overlaps(SEXP query, SEXP subject, SEXP within) try {
+	int nq, ns;
+	std::vector<const int*> qptrs=check_intervals(query, 3, nq, "query intervals should be a list of length 3");
+	std::vector<const int*> sptrs=check_intervals(subject, 3, ns, "subject intervals should be a list of length 3");
+	if (!isLogical(within) || LENGTH(within)!=1) { throw std::runtime_error("'within' specification should be a logical scalar"); }
+	const bool contained=asLogical(within);
+
+	const interval_index index(ns, sptrs[0], sptrs[1], sptrs[2]);
+	std::deque<int> qhits, shits;
+	std::vector<int> hits;
+	for (int q=0; q<nq; ++q) {
+		index.overlaps(qptrs[0][q], qptrs[1][q], qptrs[2][q], contained, hits);
+		for (size_t h=0; h<hits.size(); ++h) {
+			qhits.push_back(q+1);
+			shits.push_back(hits[h]+1);
+		}
+	}
+	return save_hits(qhits, shits);
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
@@ -0,0 +1,45 @@
+#ifndef INTERVAL_INDEX_H
+#define INTERVAL_INDEX_H
+
+#include "diffhic.h"
+#include "interval_tree.h"
+
+/* This class indexes a set of closed genomic intervals for batch overlap queries.
+ * A separate interval tree (see interval_tree.h) is built for the intervals on each 
+ * chromosome, so each query takes O(k log n) time for 'k' hits, even when a few long 
+ * intervals span most of the chromosome. Chromosomes should be supplied as positive
+ * integer codes.
+ *
+ * Hits are reported as the indices of the indexed intervals, in increasing order.
+ * 'within' reports only those intervals that contain the query interval.
+ */
+
+class interval_index {
+public:
+	interval_index(int, const int*, const int*, const int*);
+	void overlaps(int, int, int, bool, std::vector<int>&) const;
+	int size() const { return nintervals; }
+private:
+	int nintervals;
+	std::vector<interval_tree> trees;
+};
+
+/* This class indexes a set of boxes in the interaction space, where each box is
+ * defined by a first and second interval (e.g., from a pair of anchor regions).
+ * Candidates are identified with an interval index on the first intervals, and
+ * then filtered on the second intervals. Only first-to-first and second-to-second
+ * overlaps are considered, i.e., boxes are not reflected around the diagonal.
+ */
+
+class box_index {
+public:
+	box_index(int, const int*, const int*, const int*, const int*, const int*, const int*);
+	void overlaps(int, int, int, int, int, int, bool, std::vector<int>&) const;
+	int size() const { return first.size(); }
+private:
+	interval_index first;
+	const int* schr, * sstart, * send;
+	mutable std::vector<int> candidates;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef INTERVAL_TREE_H
+#define INTERVAL_TREE_H
+
+#include "diffhic.h"
+
+/* This class stores a set of closed intervals in an implicit, augmented binary search tree.
+ * Intervals are sorted by start position, and the middle interval of any stretch of the
+ * sorted array is taken as the root of the subtree for that stretch. The maximum end position
+ * in each subtree is stored at its root, so that entire subtrees can be skipped if they end
+ * before the query. All 'k' hits are identified in O(k log n) time, regardless of the lengths
+ * of the intervals.
+ *
+ * Queries report intervals that start at or before 'limit' and end at or after 'threshold'.
+ * Overlaps with a query interval use limit=query end and threshold=query start; containment
+ * of a query interval uses limit=query start and threshold=query end; and stabbing queries
+ * for a single position use that position for both. Hits are reported as the supplied indices.
+ */
+
+class interval_tree {
+public:
+	interval_tree() {}
+	interval_tree(const std::vector<int>& indices, const int* start, const int* end) : order(indices) {
+		std::stable_sort(order.begin(), order.end(), sort_row_index<int>(start));
+		const int n=order.size();
+		starts.resize(n);
+		ends.resize(n);
+		maxend.resize(n);
+		for (int i=0; i<n; ++i) {
+			starts[i]=start[order[i]];
+			ends[i]=end[order[i]];
+		}
+		fill_max(0, n);
+		return;
+	}
+
+	void query(int limit, int threshold, std::vector<int>& hits) const {
+		hits.clear();
+		search(0, starts.size(), limit, threshold, &hits);
+		return;
+	}
+	bool any(int limit, int threshold) const {
+		return search(0, starts.size(), limit, threshold, NULL);
+	}
+	int size() const { return starts.size(); }
+private:
+	std::vector<int> order, starts, ends, maxend;
+
+	int fill_max(int left, int right) {
+		if (left >= right) { return INT_MIN; }
+		const int mid=left + (right - left)/2;
+		int& curmax=(maxend[mid]=ends[mid]);
+		curmax=std::max(curmax, fill_max(left, mid));
+		curmax=std::max(curmax, fill_max(mid+1, right));
+		return curmax;
+	}
+
+	// Reports all hits if 'hits' is supplied; otherwise, returns as soon as any hit is found.
+	bool search(int left, int right, int limit, int threshold, std::vector<int>* hits) const {
+		bool found=false;
+		while (left < right) {
+			const int mid=left + (right - left)/2;
+			if (maxend[mid] < threshold) { break; }
+			if (search(left, mid, limit, threshold, hits)) {
+				found=true;
+				if (hits==NULL) { break; }
+			}
+			if (starts[mid] > limit) { break; }
+			if (ends[mid] >= threshold) {
+				found=true;
+				if (hits==NULL) { break; }
+				hits->push_back(order[mid]);
+			}
+			left=mid+1;
+		}
+		return found;
+	}
+};
+
+#endif
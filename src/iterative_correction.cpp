@@ -1,13 +1,230 @@
 #include "diffhic.h"
+#include <functional>
 
-struct orderer {
-	orderer (const double* x) : cptr(x) {}
-	bool operator() (const int& l, const int& r) const {  return cptr[l] < cptr[r]; }
+/* This compacts the bin pairs with non-NA working probabilities, along with the bins involved 
+ * in those bin pairs. Bins are renumbered from zero in order of their original (1-based) IDs,
+ * such that all subsequent calculations can be performed on contiguous arrays without checking
+ * for NA values. The original index of each retained bin pair and bin is also stored.
+ */
+
+struct compacted {
+	compacted(int npairs, int numfrags, const int* aptr, const int* tptr, const double* wptr) {
+		std::vector<int> renumbered(numfrags, -1);
+		for (int pr=0; pr<npairs; ++pr) {
+			if (ISNA(wptr[pr])) { continue; }
+			renumbered[aptr[pr]-1]=renumbered[tptr[pr]-1]=0;
+			kept.push_back(pr);
+		}
+		for (int i=0; i<numfrags; ++i) {
+			if (renumbered[i]==-1) { continue; }
+			renumbered[i]=bins.size();
+			bins.push_back(i);
+		}
+
+		const int nkept=kept.size();
+		anchor.resize(nkept);
+		target.resize(nkept);
+		working.resize(nkept);
+		for (int p=0; p<nkept; ++p) {
+			const int& pr=kept[p];
+			anchor[p]=renumbered[aptr[pr]-1];
+			target[p]=renumbered[tptr[pr]-1];
+			working[p]=wptr[pr];
+		}
+	}
+
+	// Computing the coverage of each bin with a serial scatter across bin pairs.
+	void coverage(std::vector<double>& out) const {
+		out.assign(bins.size(), 0);
+		const int nkept=kept.size();
+		for (int p=0; p<nkept; ++p) {
+			out[anchor[p]]+=working[p];
+			out[target[p]]+=working[p];
+		}
+	}
+
+	std::vector<int> kept, bins, anchor, target;
+	std::vector<double> working;
+};
+
+/* This lists the bin pairs involving each bin, in increasing order of the pair index
+ * (diagonal bin pairs are listed twice). The coverage of each bin can then be computed
+ * separately in each thread, by gathering in the same order as a serial scatter across
+ * bin pairs. This ensures that the results do not depend on the number of threads.
+ */
+
+struct bin_lists {
+	bin_lists(const compacted& data) : first(data.bins.size()+1) {
+		const int nkept=data.kept.size(), nbins=data.bins.size();
+		for (int p=0; p<nkept; ++p) {
+			++first[data.anchor[p]+1];
+			++first[data.target[p]+1];
+		}
+		for (int i=0; i<nbins; ++i) { first[i+1]+=first[i]; }
+		pairs.resize(first[nbins]);
+		std::vector<int> cursor(first.begin(), first.end()-1);
+		for (int p=0; p<nkept; ++p) {
+			pairs[cursor[data.anchor[p]]++]=p;
+			pairs[cursor[data.target[p]]++]=p;
+		}
+	}
+	std::vector<int> first, pairs;
+};
+
+/* This computes the product of the symmetric matrix of working probabilities with 'x'. Each 
+ * bin gathers across its list of bin pairs, where the diagonal bin pairs are listed twice 
+ * (consistent with their contribution to the coverage in the correction). 
+ */
+
+void balance_multiply(const compacted& data, const bin_lists& lists, const std::vector<double>& x, std::vector<double>& out, const int nt) {
+	const int nbins=data.bins.size();
+	const int* aptr=data.anchor.data(), * tptr=data.target.data(), * fptr=lists.first.data(), * lptr=lists.pairs.data();
+	const double* wptr=data.working.data(), * xptr=x.data();
+	double* optr=out.data();
+#pragma omp parallel for schedule(dynamic, 256) num_threads(nt)
+	for (int i=0; i<nbins; ++i) {
+		double cur=0;
+		for (int k=fptr[i]; k<fptr[i+1]; ++k) {
+			const int& p=lptr[k];
+			cur+=wptr[p]*xptr[aptr[p]==i ? tptr[p] : aptr[p]];
+		}
+		optr[i]=cur;
+	}
+}
+
+/* This performs Knight-Ruiz matrix balancing (Knight and Ruiz, 2013) with the BNEWT algorithm, 
+ * i.e., an inexact Newton method where each step is computed with conjugate gradient iterations
+ * that are kept within a cone around the current balancing factors. Iteration stops when the 
+ * squared residual of the row sums falls below the squared tolerance, or after 'maxit' outer 
+ * iterations. The bias for each bin is defined as the reciprocal of its balancing factor, and 
+ * the maximum fold change in the biases is stored for each outer iteration.
+ */
+
+int knight_ruiz(const compacted& data, const bin_lists& lists, const double tolerance, const int maxit, 
+		std::vector<double>& bias, std::vector<double>& steps, const int nt) {
+	const double delta=0.1, Delta=3, g=0.9, etamax=0.1;
+	const double rt=tolerance*tolerance, stop_tol=tolerance*0.5;
+	const int nbins=data.bins.size();
+	std::vector<double> x(nbins, 1), v(nbins), rk(nbins), y(nbins), z(nbins), p(nbins), w(nbins), xp(nbins);
+
+	balance_multiply(data, lists, x, v, nt);
+	double rho_km1=0, rho_km2=0;
+	for (int i=0; i<nbins; ++i) {
+		v[i]*=x[i];
+		rk[i]=1-v[i];
+		rho_km1+=rk[i]*rk[i];
+	}
+	double rout=rho_km1, rold=rout, eta=etamax;
+
+	int it=0;
+	while (rout > rt && it < maxit) {
+		std::fill(y.begin(), y.end(), 1);
+		const double innertol=std::max(eta*eta*rout, rt);
+
+		// Inner conjugate gradient iterations.
+		int k=0;
+		while (rho_km1 > innertol) {
+			++k;
+			if (k==1) {
+				rho_km1=0;
+				for (int i=0; i<nbins; ++i) {
+					z[i]=rk[i]/v[i];
+					p[i]=z[i];
+					rho_km1+=rk[i]*z[i];
+				}
+			} else {
+				const double beta=rho_km1/rho_km2;
+				for (int i=0; i<nbins; ++i) { p[i]=z[i]+beta*p[i]; }
+			}
+
+			for (int i=0; i<nbins; ++i) { xp[i]=x[i]*p[i]; }
+			balance_multiply(data, lists, xp, w, nt);
+			double pw=0, minnew=R_PosInf, maxnew=R_NegInf;
+			for (int i=0; i<nbins; ++i) {
+				w[i]=x[i]*w[i]+v[i]*p[i];
+				pw+=p[i]*w[i];
+			}
+			const double alpha=rho_km1/pw;
+			for (int i=0; i<nbins; ++i) {
+				const double ynew=y[i]+alpha*p[i];
+				if (ynew < minnew) { minnew=ynew; }
+				if (ynew > maxnew) { maxnew=ynew; }
+			}
+
+			// Stopping at the boundary of the cone, if the step would take us outside of it.
+			if (minnew <= delta || maxnew >= Delta) {
+				const bool lower=(minnew <= delta);
+				double gamma=R_PosInf;
+				for (int i=0; i<nbins; ++i) {
+					const double ap=alpha*p[i];
+					if (lower) {
+						if (ap < 0) { gamma=std::min(gamma, (delta-y[i])/ap); }
+					} else if (y[i]+ap > Delta) {
+						gamma=std::min(gamma, (Delta-y[i])/ap);
+					}
+				}
+				for (int i=0; i<nbins; ++i) { y[i]+=gamma*alpha*p[i]; }
+				break;
+			}
+
+			rho_km2=rho_km1;
+			rho_km1=0;
+			for (int i=0; i<nbins; ++i) {
+				y[i]+=alpha*p[i];
+				rk[i]-=alpha*w[i];
+				z[i]=rk[i]/v[i];
+				rho_km1+=rk[i]*z[i];
+			}
+		}
+
+		// Updating the balancing factors, and recording the maximum fold change in the biases.
+		double& maxed=(steps[it]=1);
+		for (int i=0; i<nbins; ++i) {
+			x[i]*=y[i];
+			maxed=std::max(maxed, std::max(y[i], 1/y[i]));
+		}
+		++it;
+
+		balance_multiply(data, lists, x, v, nt);
+		rho_km1=0;
+		for (int i=0; i<nbins; ++i) {
+			v[i]*=x[i];
+			rk[i]=1-v[i];
+			rho_km1+=rk[i]*rk[i];
+		}
+		rout=rho_km1;
+
+		// Updating the inner stopping criterion.
+		const double rat=rout/rold, res_norm=std::sqrt(rout), eta_o=eta;
+		rold=rout;
+		eta=g*rat;
+		if (g*eta_o*eta_o > 0.1) { eta=std::max(eta, g*eta_o*eta_o); }
+		eta=std::max(std::min(eta, etamax), stop_tol/res_norm);
+	}
+
+	for (int i=0; i<nbins; ++i) { bias[i]=1/x[i]; }
+	return it;
+}
+
+/* This performs iterative correction on the average counts for each bin pair. Bin pairs and
+ * bins are compacted after removing local, low-abundance or empty elements, so each sweep 
+ * runs without branches over contiguous arrays. If 'tol' is not NA, correction stops early
+ * once the maximum fold change in the biases is no greater than 1 + 'tol'. Alternatively,
+ * if 'knightruiz' is true, Knight-Ruiz matrix balancing is performed instead.
+ */
+
+struct by_coverage {
+	by_coverage(const double* x) : cptr(x) {}
+	bool operator() (const int& l, const int& r) const {
+		if (cptr[l]==cptr[r]) { return (l < r); }
+		return (cptr[l] < cptr[r]);
+	}
+private:
 	const double* cptr;
 };
 
 SEXP iterative_correction(SEXP avecount, SEXP anchor, SEXP target, SEXP local, 
-		SEXP nfrags, SEXP iter, SEXP exlocal, SEXP lowdiscard, SEXP winsorhigh) try {
+		SEXP nfrags, SEXP iter, SEXP exlocal, SEXP lowdiscard, SEXP winsorhigh, SEXP tol, SEXP knightruiz, SEXP nthreads) try {
 
 	// Checking vector type and length.
 	if (!isNumeric(avecount)) { throw std::runtime_error("average counts must be supplied as a double-precision vector"); }
@@ -31,6 +248,15 @@ SEXP iterative_correction(SEXP avecount, SEXP anchor, SEXP target, SEXP local,
 	const double discarded=asReal(lowdiscard);
 	if (!isNumeric(winsorhigh) || LENGTH(winsorhigh)!=1) { throw std::runtime_error("proportion to winsorize should be a double-precision scalar"); }
 	const double winsorized=asReal(winsorhigh);
+	if (!isInteger(nthreads) || LENGTH(nthreads)!=1 || asInteger(nthreads) < 1) { 
+		throw std::runtime_error("number of threads should be a positive integer scalar"); }
+	const int nt=asInteger(nthreads);
+	if (!isReal(tol) || LENGTH(tol)!=1) { throw std::runtime_error("tolerance should be a double-precision scalar"); }
+	const double tolerance=asReal(tol);
+	const bool do_stop=!ISNA(tolerance);
+	if (!isLogical(knightruiz) || LENGTH(knightruiz)!=1) { throw std::runtime_error("balancing specifier should be a logical scalar"); }
+	const bool use_kr=asLogical(knightruiz);
+	if (use_kr && !(tolerance > 0)) { throw std::runtime_error("tolerance should be positive for Knight-Ruiz balancing"); }
 	
 	SEXP output=PROTECT(allocVector(VECSXP, 3));
 try {
@@ -55,159 +281,104 @@ try {
  	 * Getting rid of unstable or extreme elements.
  	 **************************************************/
 
-	// Winsorizing for the most abundant interactions.
+	// Winsorizing for the most abundant interactions, by capping all values at the (todrop+1)-th largest value.
 	const int todrop=int(double(num_values)*winsorized);
 	if (todrop>0) {
-		int* ordered=new int[npairs];
-		try {
-			for (int i=0; i<npairs; ++i) { ordered[i]=i; }
-			orderer current(acptr);
-			std::sort(ordered, ordered+npairs, current);
-	
-			// Identifying the winsorizing value.		
-			int curcount=0;
- 		   	double winsor_val=R_NaReal;
-			for (int i=npairs-1; i>=0; --i) { 
-				const int& curo=ordered[i];
-				if (ISNA(wptr[curo])) { continue; }
-				++curcount;
-				if (curcount > todrop) { 
-					winsor_val=wptr[curo];
-					break; 
-				}
-			}
-
-			// Applying said value to all high-abundance interactions.
-			if (ISNA(winsor_val)) { throw std::runtime_error("specified winsorizing proportion censors all data"); }
-			curcount=0;
-			for (int i=npairs-1; i>=0; --i) { 
-				const int& curo=ordered[i];
-				if (ISNA(wptr[curo])) { continue; }
-				wptr[curo]=winsor_val;
-				++curcount;
-				if (curcount > todrop) { break; }
-			}		
-		} catch (std::exception& e){
-			delete [] ordered;
-			throw;
+		if (todrop >= num_values) { throw std::runtime_error("specified winsorizing proportion censors all data"); }
+		std::vector<double> retained;
+		retained.reserve(num_values);
+		for (int pr=0; pr<npairs; ++pr) {
+			if (!ISNA(wptr[pr])) { retained.push_back(wptr[pr]); }
+		}
+		std::nth_element(retained.begin(), retained.begin()+todrop, retained.end(), std::greater<double>());
+		const double winsor_val=retained[todrop];
+		for (int pr=0; pr<npairs; ++pr) {
+			if (!ISNA(wptr[pr]) && wptr[pr] > winsor_val) { wptr[pr]=winsor_val; }
 		}
-		delete[] ordered;
 	}
 
-	// Bias and coverage vectors.
-	SET_VECTOR_ELT(output, 1, allocVector(REALSXP, numfrags));
-	double* bias=REAL(VECTOR_ELT(output, 1)),
-		* biaptr=bias-1;
-	for (int i=0; i<numfrags; ++i) { bias[i]=R_NaReal; }
-	for (int pr=0; pr<npairs; ++pr) { 
-		if (!ISNA(wptr[pr])) { biaptr[aptr[pr]]=biaptr[tptr[pr]]=1; }
-	}
-	double* coverage=(double*)R_alloc(numfrags, sizeof(double));
-	for (int i=0; i<numfrags; ++i) { coverage[i]=0; }
-	double* covptr=coverage-1; // To deal with 1-based indices.
+	compacted data(npairs, numfrags, aptr, tptr, wptr);
+	std::vector<double> coverage;
 
-	// Removing low-abundance fragments.
+	// Removing low-abundance fragments, and propagating the filter to all bin pairs involving those fragments.
 	if (discarded > 0) {
-		for (int pr=0; pr<npairs; ++pr) {  // Computing the coverage.
-			if (ISNA(wptr[pr])) { continue; }
-			covptr[aptr[pr]]+=wptr[pr]; 
-			covptr[tptr[pr]]+=wptr[pr];
-        }
-
-		int* ordering=new int [numfrags];
-		try {
-			for (int i=0; i<numfrags; ++i) { ordering[i]=i; }
-			orderer current(coverage);
-			std::sort(ordering, ordering+numfrags, current);
-		
-			// Ignoring empty rows.
-			int counter=0;
-			while (counter < numfrags && ISNA(bias[ordering[counter]])){ ++counter; }
-				
-			// Filtering out low-abundance rows.
-			const int leftover=int(discarded*double(numfrags-counter))+counter;
-			while (counter < leftover) { 
-				bias[ordering[counter]]=R_NaReal;
-				++counter; 
-			}
+		const int nbins=data.bins.size(), leftover=int(discarded*double(nbins));
+		if (leftover > 0) {
+			data.coverage(coverage);
+			std::vector<int> ordering(nbins);
+			for (int i=0; i<nbins; ++i) { ordering[i]=i; }
+			std::nth_element(ordering.begin(), ordering.begin()+leftover, ordering.end(), by_coverage(coverage.data()));
+			std::vector<bool> dropped(nbins);
+			for (int i=0; i<leftover; ++i) { dropped[ordering[i]]=true; }
 
-			// Setting everything else back to zero.
-			while (counter < numfrags) { 
-				coverage[ordering[counter]]=0;
-				++counter;
+			const int nkept=data.kept.size();
+			for (int p=0; p<nkept; ++p) {
+				if (dropped[data.anchor[p]] || dropped[data.target[p]]) { wptr[data.kept[p]]=R_NaReal; }
 			}
-		} catch (std::exception& e) { 
-			delete [] ordering;
-			throw;
-		}
-		delete [] ordering;
-	
-		// Propogating the filters through the interactions to remove anything with an anchor in the removed fragments.
-		for (int pr=0; pr<npairs; ++pr) {
-			if (ISNA(wptr[pr])) { continue; }
-			if (ISNA(biaptr[aptr[pr]]) || ISNA(biaptr[tptr[pr]])) { wptr[pr]=R_NaReal; }  
-		}
-		for (int i=0; i<numfrags; ++i) { bias[i]=R_NaReal; }
-		for (int pr=0; pr<npairs; ++pr) { 
-			if (!ISNA(wptr[pr])) { biaptr[aptr[pr]]=biaptr[tptr[pr]]=1; }
+			data=compacted(npairs, numfrags, aptr, tptr, wptr);
 		}
 	}
 	
 	// Something to hold a diagnostic (i.e., the maximum step).
-	SET_VECTOR_ELT(output, 2, allocVector(REALSXP, iterations));
-	double* optr=REAL(VECTOR_ELT(output, 2));
+	const int nbins=data.bins.size(), nkept=data.kept.size();
+	std::vector<double> steps(iterations), compact_bias(nbins, 1);
+	int completed=0;
+	const bin_lists lists(data);
 
     /********************************************************
  	 * Now, actually performing the iterative correction. ***
  	 ********************************************************/
 
-	for (int it=0; it<iterations; ++it) {
-		for (int pr=0; pr<npairs; ++pr) {  // Computing the coverage (ignoring locals, if necessary).
-			if (ISNA(wptr[pr])) { continue; }
-			covptr[aptr[pr]]+=wptr[pr]; 
-			covptr[tptr[pr]]+=wptr[pr];
-        }
-		
-		/* Computing the 'aditional bias' vector, to take the mean across all fragments.
-		 * The exact value of the mean doesn't really matter, it just serves to slow down 
-		 * the algorithm to avoid overshooting the mark and lack of convergence. Everything
-		 * ends up being the same so long as the column sums approach 1.
-		 */
-//		double mean_of_all=0;
-//		for (int i=0; i<numfrags; ++i) { if (!ISNA(coverage[i])) { mean_of_all+=coverage[i]; } }
-//		mean_of_all/=numfrags;
-//		for (int i=0; i<numfrags; ++i) { if (!ISNA(coverage[i])) { coverage[i]/=mean_of_all; } }
-
-		/* Okay, that didn't really work. The strategy that is described in the paper fails to
- 		 * give me contact probabilities that sum to 1. So instead, I'm using the coverage
- 		 * itself to divide the working probabilities. Square rooting is necessary to avoid
- 		 * instability during iteration.
- 		 */
-		for (int i=0; i<numfrags; ++i) { if (!ISNA(bias[i])) { coverage[i]=std::sqrt(coverage[i]); } }
-
-		// Dividing the working matrix with the (geometric mean of the) additional biases.	
-		for (int pr=0; pr<npairs; ++pr){ 
-			if (!ISNA(wptr[pr])) { wptr[pr]/=covptr[aptr[pr]]*covptr[tptr[pr]]; }
-        }
-		
-		// Multiplying the biases by additional biases, and cleaning out coverage. We store
-		// the maximum step to see how far off convergence it is.
-		double& maxed=(optr[it]=0);
-		for (int i=0; i<numfrags; ++i) {			
-			if (!ISNA(bias[i])) {
-				double& cur_cov=coverage[i];
-				if (cur_cov > maxed) { maxed=cur_cov; }
-				else if (1/cur_cov > maxed) { maxed=1/cur_cov; }
-				bias[i]*=cur_cov;
-				cur_cov=0;
+	if (use_kr) {
+		completed=knight_ruiz(data, lists, tolerance, iterations, compact_bias, steps, nt);
+	} else {
+		coverage.resize(nbins);
+		const int* captr=data.anchor.data(), * ctptr=data.target.data(), * fptr=lists.first.data(), * lsptr=lists.pairs.data();
+		double* cwptr=data.working.data(), * covptr=coverage.data();
+
+		for (int it=0; it<iterations; ++it) {
+			/* Computing the coverage (ignoring locals, if necessary). The strategy described in 
+			 * the paper (dividing by the mean coverage) fails to give contact probabilities that
+			 * sum to 1. So instead, I'm using the coverage itself to divide the working 
+			 * probabilities. Square rooting is necessary to avoid instability during iteration.
+			 */
+#pragma omp parallel for schedule(dynamic, 256) num_threads(nt)
+			for (int i=0; i<nbins; ++i) {
+				double cur_cov=0;
+				for (int k=fptr[i]; k<fptr[i+1]; ++k) { cur_cov+=cwptr[lsptr[k]]; }
+				covptr[i]=std::sqrt(cur_cov);
+			}
+
+			// Dividing the working matrix with the (geometric mean of the) additional biases.	
+#pragma omp parallel for schedule(static) num_threads(nt)
+			for (int p=0; p<nkept; ++p) { cwptr[p]/=covptr[captr[p]]*covptr[ctptr[p]]; }
+			
+			// Multiplying the biases by additional biases. We store the maximum step to see how far off convergence it is.
+			double& maxed=(steps[it]=0);
+			for (int i=0; i<nbins; ++i) {
+				const double& cur_cov=covptr[i];
+				maxed=std::max(maxed, std::max(cur_cov, 1/cur_cov));
+				compact_bias[i]*=cur_cov;
 			}
+			completed=it+1;
+			if (do_stop && maxed <= 1 + tolerance) { break; }
 		}
-    }
+	}
+
+	SET_VECTOR_ELT(output, 1, allocVector(REALSXP, numfrags));
+	double* bias=REAL(VECTOR_ELT(output, 1)),
+		* biaptr=bias-1; // To deal with 1-based indices.
+	std::fill(bias, bias+numfrags, R_NaReal);
+	for (int i=0; i<nbins; ++i) { bias[data.bins[i]]=compact_bias[i]; }
+
+	SET_VECTOR_ELT(output, 2, allocVector(REALSXP, completed));
+	std::copy(steps.begin(), steps.begin()+completed, REAL(VECTOR_ELT(output, 2)));
 
 	/* Recalculating the contact probabilities, using the estimated biases, 
 	 * to get normalized values for Winsorized or discarded bin pairs.
 	 * Discarded bins can't be salvaged, though.
 	 */
+#pragma omp parallel for schedule(static) num_threads(nt)
 	for (int pr=0; pr<npairs; ++pr) {  
 		if (ISNA(biaptr[aptr[pr]]) || ISNA(biaptr[tptr[pr]])) { continue; }
 		wptr[pr] = acptr[pr]/biaptr[aptr[pr]]/biaptr[tptr[pr]];
@@ -222,3 +393,91 @@ try {
 	return mkString(e.what());
 }
 
+struct sort_first_only {
+	bool operator() (const std::pair<int, double>& l, const std::pair<int, double>& r) const { return l.first < r.first; }
+};
+
+/* This performs a single pass of out-of-core iterative correction over a chunk of bin pairs
+ * for one chromosome pair. Given the current biases, the (winsorized) count for each bin pair 
+ * is divided by the biases of its two bins, and added to the coverage of each bin. Bin pairs
+ * are excluded if either bin has an NA bias, or if the difference between their anchor IDs 
+ * is no greater than 'limit' (set to -1 to retain all bin pairs). Only the bins touched by 
+ * this chunk are reported, along with their partial coverage, so that the cost of each call 
+ * does not depend on the total number of bins. If 'truth' is true, the corrected value of 
+ * each bin pair is returned instead.
+ */
+
+SEXP stream_correction(SEXP anchor, SEXP target, SEXP count, SEXP bias, SEXP winsor, SEXP limit, SEXP truth) try {
+	if (!isInteger(anchor) || !isInteger(target) || !isInteger(count)) { throw std::runtime_error("anchor IDs, target IDs and counts should be integer vectors"); }
+	const int npairs=LENGTH(anchor);
+	if (LENGTH(target)!=npairs || LENGTH(count)!=npairs) { throw std::runtime_error("lengths of vectors are not equal"); }
+	if (!isReal(bias)) { throw std::runtime_error("biases should be a double-precision vector"); }
+	const int numfrags=LENGTH(bias);
+	if (!isReal(winsor) || LENGTH(winsor)!=1) { throw std::runtime_error("winsorizing value should be a double-precision scalar"); }
+	const double winsor_val=asReal(winsor);
+	const bool do_winsor=!ISNA(winsor_val);
+	if (!isInteger(limit) || LENGTH(limit)!=1) { throw std::runtime_error("exclusion limit should be an integer scalar"); }
+	const int excluded=asInteger(limit);
+	if (!isLogical(truth) || LENGTH(truth)!=1) { throw std::runtime_error("truth specifier should be a logical scalar"); }
+	const bool get_truth=asLogical(truth);
+
+	const int* aptr=INTEGER(anchor), * tptr=INTEGER(target), * cptr=INTEGER(count);
+	const double* biaptr=REAL(bias)-1; // To deal with 1-based indices.
+	for (int pr=0; pr<npairs; ++pr) {
+		if (aptr[pr] < 1 || aptr[pr] > numfrags || tptr[pr] < 1 || tptr[pr] > numfrags) { throw std::runtime_error("bin index out of range"); }
+	}
+	
+	if (get_truth) {
+		SEXP output=PROTECT(allocVector(REALSXP, npairs));
+		double* optr=REAL(output);
+		for (int pr=0; pr<npairs; ++pr) {
+			const double& abias=biaptr[aptr[pr]], &tbias=biaptr[tptr[pr]];
+			optr[pr]=(ISNA(abias) || ISNA(tbias) ? R_NaReal : cptr[pr]/abias/tbias);
+		}
+		UNPROTECT(1);
+		return output;
+	}
+
+	// Collecting contributions for each bin, and then summing them after sorting by bin.
+	std::vector<std::pair<int, double> > contributions;
+	for (int pr=0; pr<npairs; ++pr) {
+		const int& a=aptr[pr], &t=tptr[pr];
+		if (a - t <= excluded) { continue; }
+		const double& abias=biaptr[a], &tbias=biaptr[t];
+		if (ISNA(abias) || ISNA(tbias)) { continue; }
+		double curcount=cptr[pr];
+		if (do_winsor && curcount > winsor_val) { curcount=winsor_val; }
+		curcount/=abias*tbias;
+		contributions.push_back(std::make_pair(a, curcount));
+		contributions.push_back(std::make_pair(t, curcount));
+	}
+	std::stable_sort(contributions.begin(), contributions.end(), sort_first_only());
+	int nbins=0;
+	for (size_t i=0; i<contributions.size(); ++i) {
+		if (i==0 || contributions[i].first!=contributions[i-1].first) { ++nbins; }
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(INTSXP, nbins));
+		int* boptr=INTEGER(VECTOR_ELT(output, 0));
+		SET_VECTOR_ELT(output, 1, allocVector(REALSXP, nbins));
+		double* coptr=REAL(VECTOR_ELT(output, 1));
+		int b=-1;
+		for (size_t i=0; i<contributions.size(); ++i) {
+			if (i==0 || contributions[i].first!=contributions[i-1].first) { 
+				++b;
+				boptr[b]=contributions[i].first;
+				coptr[b]=0;
+			}
+			coptr[b]+=contributions[i].second;
+		}
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
@@ -0,0 +1,199 @@
+#include "diffhic.h"
+#include "neighbors.h"
+#include "Rmath.h"
+
+/* This tests for local enrichment of each bin pair against each of its neighbourhoods,
+ * using the lambda-chunking strategy from HiCCUPS. Counts are pooled across libraries,
+ * and the expected count for each neighbourhood is defined as the neighbourhood count
+ * divided by its area. Bin pairs are assigned to chunks based on their expected counts,
+ * where chunk 0 contains expected values in [0, 1] and chunk 'c' contains values in
+ * (step^(c-1), step^c]. A one-sided Poisson test is performed using the upper bound of
+ * the chunk as the mean, and the Benjamini-Hochberg correction is applied within each
+ * chunk. Bin pairs with zero neighbourhood areas are not tested.
+ *
+ * If 'scaling' is not NULL, it should contain a double-precision vector for each neighbourhood.
+ * The expected count for each bin pair is multiplied by the corresponding value, to account for
+ * the distance-dependent decay in intensity (see neighbor_decay below).
+ */
+
+struct sort_by_pvalue {
+	sort_by_pvalue(const double* p) : ptr(p) {}
+	bool operator() (const int& l, const int& r) const {
+		if (ptr[l]==ptr[r]) { return (l < r); }
+		return (ptr[l] < ptr[r]);
+	}
+private:
+	const double* ptr;
+};
+
+SEXP lambda_chunk_test(SEXP count, SEXP neighbors, SEXP areas, SEXP scaling, SEXP step) try {
+	if (!isInteger(count)) { throw std::runtime_error("matrix of counts should be integer"); }
+	const int npair=nrows(count), nlibs=ncols(count);
+	if (!isNewList(neighbors) || !isNewList(areas)) { throw std::runtime_error("neighborhood counts and areas should be lists"); }
+	const int nmodes=LENGTH(neighbors);
+	if (LENGTH(areas)!=nmodes) { throw std::runtime_error("number of neighborhood counts and areas should be the same"); }
+	const bool use_scaling=!isNull(scaling);
+	if (use_scaling && (!isNewList(scaling) || LENGTH(scaling)!=nmodes)) { throw std::runtime_error("scaling factors should be a list of the same length as the neighborhood counts"); }
+	if (!isReal(step) || LENGTH(step)!=1) { throw std::runtime_error("lambda step should be a double-precision scalar"); }
+	const double logstep=std::log(asReal(step));
+	if (!(logstep > 0)) { throw std::runtime_error("lambda step should be greater than 1"); }
+
+	// Pooling counts across libraries.
+	std::vector<int> observed(npair);
+	const int* cptr=INTEGER(count);
+	for (int lib=0; lib<nlibs; ++lib) {
+		for (int i=0; i<npair; ++i) { observed[i]+=cptr[lib*npair+i]; }
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 3));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(VECSXP, nmodes));
+		SEXP exp_out=VECTOR_ELT(output, 0);
+		SET_VECTOR_ELT(output, 1, allocVector(VECSXP, nmodes));
+		SEXP p_out=VECTOR_ELT(output, 1);
+		SET_VECTOR_ELT(output, 2, allocVector(VECSXP, nmodes));
+		SEXP fdr_out=VECTOR_ELT(output, 2);
+		std::vector<int> chunk(npair), pooled(npair);
+		std::vector<std::deque<int> > by_chunk;
+
+		for (int m=0; m<nmodes; ++m) {
+			SEXP curcount=VECTOR_ELT(neighbors, m), curarea=VECTOR_ELT(areas, m);
+			if (!isInteger(curcount) || nrows(curcount)!=npair || ncols(curcount)!=nlibs) {
+				throw std::runtime_error("neighborhood counts should be an integer matrix of the same dimensions as the counts");
+			}
+			if (!isInteger(curarea) || LENGTH(curarea)!=npair) { throw std::runtime_error("neighborhood areas should be an integer vector of length equal to the number of bin pairs"); }
+			const int* ncptr=INTEGER(curcount), * naptr=INTEGER(curarea);
+			const double* nsptr=NULL;
+			if (use_scaling) {
+				SEXP curscale=VECTOR_ELT(scaling, m);
+				if (!isReal(curscale) || LENGTH(curscale)!=npair) { throw std::runtime_error("scaling factors should be a double-precision vector of length equal to the number of bin pairs"); }
+				nsptr=REAL(curscale);
+			}
+
+			SET_VECTOR_ELT(exp_out, m, allocVector(REALSXP, npair));
+			double* eptr=REAL(VECTOR_ELT(exp_out, m));
+			SET_VECTOR_ELT(p_out, m, allocVector(REALSXP, npair));
+			double* pptr=REAL(VECTOR_ELT(p_out, m));
+			SET_VECTOR_ELT(fdr_out, m, allocVector(REALSXP, npair));
+			double* fptr=REAL(VECTOR_ELT(fdr_out, m));
+
+			std::fill(pooled.begin(), pooled.end(), 0);
+			for (int lib=0; lib<nlibs; ++lib) {
+				for (int i=0; i<npair; ++i) { pooled[i]+=ncptr[lib*npair+i]; }
+			}
+
+			// Computing expected values and p-values for each bin pair, and assigning them to chunks.
+			by_chunk.clear();
+			for (int i=0; i<npair; ++i) {
+				if (naptr[i] <= 0) {
+					eptr[i]=pptr[i]=fptr[i]=R_NaReal;
+					continue;
+				}
+				double expected=double(pooled[i])/naptr[i];
+				if (use_scaling) { expected*=nsptr[i]; }
+				eptr[i]=expected;
+				int& curchunk=chunk[i];
+				curchunk=(expected <= 1 ? 0 : int(std::ceil(std::log(expected)/logstep)));
+				if (size_t(curchunk) >= by_chunk.size()) { by_chunk.resize(curchunk+1); }
+				by_chunk[curchunk].push_back(i);
+
+				const double lambda=std::exp(curchunk*logstep);
+				pptr[i]=(observed[i] > 0 ? ppois(observed[i]-1, lambda, 0, 0) : 1);
+			}
+
+			// Applying the BH correction within each chunk.
+			for (size_t c=0; c<by_chunk.size(); ++c) {
+				std::deque<int>& current=by_chunk[c];
+				if (current.empty()) { continue; }
+				std::sort(current.begin(), current.end(), sort_by_pvalue(pptr));
+				const int ntests=current.size();
+				double running_min=1;
+				for (int k=ntests-1; k>=0; --k) {
+					const int& i=current[k];
+					const double adjusted=pptr[i]*ntests/(k+1);
+					if (adjusted < running_min) { running_min=adjusted; }
+					fptr[i]=running_min;
+				}
+			}
+		}
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+/* This computes the scaling factor for the expected count of each intra-chromosomal bin pair
+ * against each of its neighbourhoods, as done in HiCCUPS. Given the expected count 'E(d)' for 
+ * bin pairs at each distance 'd' (in bins) on the chromosome, the neighbourhood count is scaled 
+ * by 'E(d)' of the bin pair divided by the sum of 'E' across all bin pairs in the neighbourhood.
+ * This is reported as a factor on the neighbourhood count divided by its area, such that a flat 
+ * trend yields factors of unity. The sum for each row of each neighbourhood is obtained from 
+ * cumulative sums of 'E', as all bin pairs in that row have consecutive distances.
+ */
+
+template<class Shape>
+double scale_by_decay(Shape shape, const int a, const int t, const std::vector<double>& cumexp, const int nbins) {
+	double total=0;
+	int area=0;
+	do {
+		shape.set(a, t);
+		if (shape.row < 0 || shape.row >= nbins) { continue; }
+		area+=shape.right-shape.left;
+		total+=cumexp[shape.row-shape.left+1]-cumexp[shape.row-shape.right+1];
+	} while (shape.bump_level());
+	if (area==0 || !(total > 0)) { return 1; }
+	return (cumexp[a-t+1]-cumexp[a-t])*area/total;
+}
+
+SEXP neighbor_decay(SEXP anchors, SEXP targets, SEXP expected, SEXP flank, SEXP exclude) try {
+	if (!isInteger(anchors) || !isInteger(targets)) { throw std::runtime_error("anchor and target indices should be integer"); }
+	const int npair=LENGTH(anchors);
+	if (LENGTH(targets)!=npair) { throw std::runtime_error("anchor and target vectors should be of the same length"); }
+	if (!isReal(expected)) { throw std::runtime_error("expected values should be double-precision"); }
+	const int nbins=LENGTH(expected);
+	if (!isInteger(flank) || LENGTH(flank)!=1) { throw std::runtime_error("flank width must be an integer scalar"); }
+	const int fwidth=asInteger(flank);
+	if (!isInteger(exclude) || LENGTH(exclude)!=1) { throw std::runtime_error("exclusion width must be an integer scalar"); }
+	const int xwidth=asInteger(exclude);
+
+	std::vector<double> cumexp(nbins+1);
+	const double* eptr=REAL(expected);
+	for (int d=0; d<nbins; ++d) { cumexp[d+1]=cumexp[d]+eptr[d]; }
+
+	const int* aptr=INTEGER(anchors), * tptr=INTEGER(targets);
+	const int nmodes=4;
+	SEXP output=PROTECT(allocVector(VECSXP, nmodes));
+	try {
+		std::vector<double*> optrs(nmodes);
+		for (int m=0; m<nmodes; ++m) {
+			SET_VECTOR_ELT(output, m, allocVector(REALSXP, npair));
+			optrs[m]=REAL(VECTOR_ELT(output, m));
+		}
+
+		bottomright br(fwidth, nbins, true, xwidth);
+		updown ud(fwidth, nbins, true, xwidth);
+		leftright lr(fwidth, nbins, true, xwidth);
+		allaround aa(fwidth, nbins, true, xwidth);
+		for (int i=0; i<npair; ++i) {
+			const int& a=aptr[i], & t=tptr[i];
+			if (t < 0 || a < t || a >= nbins) { throw std::runtime_error("anchor and target indices should be intra-chromosomal and within range"); }
+			optrs[0][i]=scale_by_decay(br, a, t, cumexp, nbins);
+			optrs[1][i]=scale_by_decay(ud, a, t, cumexp, nbins);
+			optrs[2][i]=scale_by_decay(lr, a, t, cumexp, nbins);
+			optrs[3][i]=scale_by_decay(aa, a, t, cumexp, nbins);
+		}
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
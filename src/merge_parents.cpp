@@ -0,0 +1,111 @@
+#include "read_count.h"
+
+/* This identifies the unique parent bin pairs across multiple sets of bin pairs, 
+ * where each set contains the parent anchor and target IDs for its bin pairs. 
+ * Each set is usually sorted by parent IDs (as child bins are nested within parents 
+ * in the same order), in which case the sets are merged in a single linear pass. 
+ * Otherwise, the set is sorted beforehand. Parent bin pairs are numbered in order of 
+ * their anchor and target IDs, and the index of the parent is returned for each 
+ * bin pair in each set, along with the anchor and target IDs of each parent.
+ */
+
+struct sort_by_parent {
+	sort_by_parent(const int* a, const int* t) : aptr(a), tptr(t) {}
+	bool operator() (const int& l, const int& r) const {
+		if (aptr[l]!=aptr[r]) { return (aptr[l] < aptr[r]); }
+		if (tptr[l]!=tptr[r]) { return (tptr[l] < tptr[r]); }
+		return (l < r);
+	}
+private:
+	const int* aptr, * tptr;
+};
+
+SEXP merge_parents(SEXP anchors, SEXP targets) try {
+	if (!isNewList(anchors) || !isNewList(targets)) { throw std::runtime_error("parent IDs should be supplied as lists"); }
+	const int nsets=LENGTH(anchors);
+	if (LENGTH(targets)!=nsets) { throw std::runtime_error("lists of anchor and target IDs should be of the same length"); }
+
+	// Setting up orderings for each set, if it is not already sorted.
+	std::vector<const int*> aptrs(nsets), tptrs(nsets);
+	std::vector<int> nums(nsets);
+	std::vector<std::vector<int> > orderings(nsets);
+	for (int s=0; s<nsets; ++s) {
+		SEXP curanchor=VECTOR_ELT(anchors, s), curtarget=VECTOR_ELT(targets, s);
+		if (!isInteger(curanchor) || !isInteger(curtarget)) { throw std::runtime_error("parent IDs should be integer vectors"); }
+		const int n=LENGTH(curanchor);
+		if (LENGTH(curtarget)!=n) { throw std::runtime_error("anchor and target ID vectors should be of the same length"); }
+		const int* a=INTEGER(curanchor), * t=INTEGER(curtarget);
+		for (int i=0; i<n; ++i) {
+			if (a[i]==NA_INTEGER || t[i]==NA_INTEGER) { throw std::runtime_error("parent IDs should not be missing"); }
+		}
+		aptrs[s]=a;
+		tptrs[s]=t;
+		nums[s]=n;
+
+		bool sorted=true;
+		for (int i=1; i<n && sorted; ++i) {
+			sorted=(a[i] > a[i-1] || (a[i]==a[i-1] && t[i] >= t[i-1]));
+		}
+		if (!sorted) {
+			std::vector<int>& current=orderings[s];
+			current.resize(n);
+			for (int i=0; i<n; ++i) { current[i]=i; }
+			std::sort(current.begin(), current.end(), sort_by_parent(a, t));
+		}
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 3));
+	try {
+		SET_VECTOR_ELT(output, 0, allocVector(VECSXP, nsets));
+		SEXP index_out=VECTOR_ELT(output, 0);
+		std::vector<int*> iptrs(nsets);
+		for (int s=0; s<nsets; ++s) {
+			SET_VECTOR_ELT(index_out, s, allocVector(INTSXP, nums[s]));
+			iptrs[s]=INTEGER(VECTOR_ELT(index_out, s));
+		}
+
+		// Merging the sorted streams with a priority queue, as in the read pair counting functions.
+		std::vector<int> positions(nsets);
+		pair_queue next;
+		for (int s=0; s<nsets; ++s) {
+			if (nums[s]) { 
+				const int i=(orderings[s].empty() ? 0 : orderings[s][0]);
+				next.push(coord(aptrs[s][i], tptrs[s][i], s));
+			}
+		}
+
+		std::deque<int> parent_a, parent_t;
+		while (!next.empty()) {
+			const coord current=next.top();
+			next.pop();
+			if (parent_a.empty() || parent_a.back()!=current.anchor || parent_t.back()!=current.target) {
+				parent_a.push_back(current.anchor);
+				parent_t.push_back(current.target);
+			}
+
+			const int& s=current.library;
+			int& pos=positions[s];
+			const std::vector<int>& curorder=orderings[s];
+			iptrs[s][curorder.empty() ? pos : curorder[pos]]=parent_a.size();
+			++pos;
+			if (pos < nums[s]) {
+				const int i=(curorder.empty() ? pos : curorder[pos]);
+				next.push(coord(aptrs[s][i], tptrs[s][i], s));
+			}
+		}
+
+		const int nparents=parent_a.size();
+		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, nparents));
+		std::copy(parent_a.begin(), parent_a.end(), INTEGER(VECTOR_ELT(output, 1)));
+		SET_VECTOR_ELT(output, 2, allocVector(INTSXP, nparents));
+		std::copy(parent_t.begin(), parent_t.end(), INTEGER(VECTOR_ELT(output, 2)));
+	} catch (std::exception& e) {
+		UNPROTECT(1);
+		throw;
+	}
+
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
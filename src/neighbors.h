@@ -3,7 +3,7 @@
 
 #include "diffhic.h"
 
-/* There are several virtual methods here:
+/* There are several methods here:
  *
  * - set(), which specifies the bin pair of interest and computes the left/right boundaries of a given neighbourhood at a given anchor.
  *   For reference, the interaction space is defined here such that each row is an anchor value and each column is a target.
@@ -20,54 +20,164 @@
  * Note that set() will happily give anchors that are negative or greater than the largest possible anchor.
  * These should be ignored, using 'continue' for negative anchors and 'break' for above-maximal anchors when looping across bin pairs.
  *
+ * The methods are not virtual, as they are called for every bin pair at every level. Instead, the calling
+ * functions are templated on the neighbourhood class, so that set() and bump_level() can be inlined.
  */
 
-
 struct basic {
 	basic(int, int, bool, int);
-	virtual void set (int, int)=0;
-	virtual ~basic() {};
-	virtual bool bump_level ()=0; 
 	int row, left, right;
 protected:
+	basic(int, bool);
 	int level, width, tlen;
 	bool intra;
 	int exclude;
-	void restrain ();
+	void restrain () {
+		if (left < 0) { left=0; }
+		if (intra) {
+			if (right > row) { right=row+1; }
+		} else if (right > tlen) { right=tlen; } // For intra's, right will hit diagonal; no need to worry about tlen.
+		if (left > right) { left=right; } // Avoid negative areas in calling function.
+	}
 };
 
+/* The bottomright class identifies all bin pairs in a square with sides 'w'.
+ * The bin pair of interest lies at the topleft corner.
+ */
+
 struct bottomright : public basic { 
 	bottomright(int, int, bool, int);
-	~bottomright() {};
-	bool bump_level();
-	void set(int, int);
+	bool bump_level() { 
+		if (level >= 0) { return false; }
+		++level;
+		return true;
+	}
+	void set(int a, int t) {
+		row=a+level;
+		left=(level < -exclude ? t : t+exclude+1);
+		right=t+width+1; 
+		restrain();
+	}
 };
 
+/* The updown class identifies all bin pairs in a vertical line of length 'w*2+1'.
+ * The bin pair of interest lies in the centre.
+ */
+
 struct updown : public basic {
 	updown(int, int, bool, int);
-	~updown() {};
-	bool bump_level();
-	void set(int, int);
+	bool bump_level() { 
+		if (level >= width) { return false; }
+		++level;
+		if (level==-exclude) { level=exclude+1; }
+		return true; 
+	}
+	void set(int a, int t) {
+		row=a+level;
+		left=t;
+		right=t+1;
+		restrain();
+	}
 };
 
+/* The leftright class identifies all bin pairs in a horizontal line of length 'w*2+1'.
+ * The bin pair of interest lies in the centre. Here, bumping is done to cycle twice over 
+ * each level; once to get the left side of the line, and again to get the right side.
+ */
+
 struct leftright : public basic {
 	leftright(int, int, bool, int);
-	~leftright() {};
-	bool bump_level();
-	void set(int, int);
+	bool bump_level() { 
+		if (onleft) { 
+			onleft=false;
+			return true;
+		} else {
+			return false; 
+		}
+	}
+	void set(int a, int t) { 
+		row=a;
+		if (onleft) {
+			left=t-width;
+			right=t-exclude;
+		} else {
+			left=t+exclude+1;
+			right=t+width+1;
+		} 
+		restrain(); 
+	}	
 protected:
     bool onleft;
 };
 
+/* The allaround class identifies all bin pairs in a surrounding square centred at the
+ * bin pair of interest and excluding it. Here, bumping switches between the left and 
+ * right sides if the stretch of bins is interrupted by the bin pairs to be excluded.
+ */
+
 enum Rangetype { FULLRANGE, LEFTSIDE, RIGHTSIDE };
 
 struct allaround : public basic {
 	allaround(int, int, bool, int);
-	~allaround() {};
-	bool bump_level();
-	void set(int, int);
+	bool bump_level () { 
+		if (rangemode==FULLRANGE) {
+			if (level==-exclude-1) { 
+				rangemode=LEFTSIDE;
+			} else if (level >= width) { 
+				return false; 
+			}
+			++level;
+		} else if (rangemode==LEFTSIDE) {
+			rangemode=RIGHTSIDE; 
+		} else if (rangemode==RIGHTSIDE) {
+			if (level==exclude) {
+				rangemode=FULLRANGE;
+			} else {
+				rangemode=LEFTSIDE;
+			}
+			++level;
+		}
+		return true;
+	}
+	void set(int a, int t) {
+		row=a+level;
+		if (rangemode==FULLRANGE) {
+			left=t-width;
+			right=t+width+1;
+		} else if (rangemode==LEFTSIDE) {
+			left=t-width;
+			right=t-exclude;
+		} else if (rangemode==RIGHTSIDE) {
+			left=t+exclude+1;
+			right=t+width+1;
+		} 
+		restrain();		
+	}
 protected:
     Rangetype rangemode;
 };
 
+/* The kernel class identifies all bin pairs in an arbitrary stencil, specified as a logical 
+ * matrix with odd dimensions where the bin pair of interest lies in the centre. Rows of the 
+ * stencil correspond to anchors and columns correspond to targets. Each row is split into
+ * runs of contiguous TRUE values, and bumping cycles through all runs in order of the rows.
+ */
+
+struct kernel : public basic {
+	kernel(const int*, int, int, int, bool);
+	bool bump_level() {
+		++current;
+		return (current < levels.size());
+	}
+	void set(int a, int t) {
+		row=a+levels[current];
+		left=t+lefts[current];
+		right=t+rights[current];
+		restrain();
+	}
+protected:
+	std::vector<int> levels, lefts, rights;
+	size_t current;
+};
+
 #endif
@@ -1,5 +1,79 @@
 #include "diffhic.h"
 #include "neighbors.h"
+#include "summed_area.h"
+
+/* This sweeps through all bin pairs in a chromosome pair to compute the counts for
+ * a given neighbourhood, for all libraries at once. Counts should be transposed so
+ * that the values for all libraries in each bin pair are contiguous, allowing the 
+ * running sums to be updated as a vector. This also means that the index sweeps and 
+ * neighbourhood areas only need to be computed once, rather than once per library.
+ */
+
+template<class Shape>
+void sweep_neighborhood(Shape& current, const int* aptr, const int* tptr, const int* cptr, 
+		const int npair, const int nlibs, const int alength, int* collected, int* nptr) {
+	int curpair, left_index, right_index,
+		left_edge, right_edge, cur_anchor; 
+	std::vector<int> running_sum(nlibs);
+	int* rsptr=running_sum.data();
+
+	// Iterating across all flank widths.
+	do {
+		std::fill(running_sum.begin(), running_sum.end(), 0);
+		left_index=0;
+		right_index=0;
+		
+		for (curpair=0; curpair<npair; ++curpair) {
+			current.set(aptr[curpair], tptr[curpair]);
+			cur_anchor=current.row;
+			if (cur_anchor >= alength) { break; }
+			left_edge=current.left;
+			right_edge=current.right;
+
+			// Identifying all bin pairs in the relevant range.
+			while (left_index < npair && (aptr[left_index] < cur_anchor || 
+					(aptr[left_index]==cur_anchor && tptr[left_index] < left_edge))) {
+				const int* curcounts=cptr+left_index*nlibs;
+				for (int lib=0; lib<nlibs; ++lib) { rsptr[lib] -= curcounts[lib]; }
+				++left_index;
+			}
+
+			while (right_index < npair && (aptr[right_index]<cur_anchor || 
+					(aptr[right_index]==cur_anchor && tptr[right_index] < right_edge))) { 
+				const int* curcounts=cptr+right_index*nlibs;
+				for (int lib=0; lib<nlibs; ++lib) { rsptr[lib] += curcounts[lib]; }
+				++right_index;		
+			}
+
+			// Adding them onto the current location (except if the anchor is negative;
+			// skipping needs to be done here, as running_sum still needs to be calculated).
+			if (cur_anchor <  0) { continue; }
+			int* curout=collected+curpair*nlibs;
+			for (int lib=0; lib<nlibs; ++lib) { curout[lib] += rsptr[lib]; }
+			nptr[curpair] += right_edge - left_edge;
+		}
+	} while (current.bump_level());
+	return;
+}
+
+/* Transposing counts between the column-major matrices used by R and the 
+ * library-contiguous format used in sweep_neighborhood.
+ */
+
+void to_contiguous(const int* cptr, int npair, int nlibs, std::vector<int>& transposed) {
+	transposed.resize(npair*nlibs);
+	for (int lib=0; lib<nlibs; ++lib) {
+		for (int curpair=0; curpair<npair; ++curpair) { transposed[curpair*nlibs+lib]=cptr[lib*npair+curpair]; }
+	}
+	return;
+}
+
+void from_contiguous(const std::vector<int>& transposed, int npair, int nlibs, int* optr) {
+	for (int lib=0; lib<nlibs; ++lib) {
+		for (int curpair=0; curpair<npair; ++curpair) { optr[lib*npair+curpair]=transposed[curpair*nlibs+lib]; }
+	}
+	return;
+}
 
 SEXP quadrant_bg (SEXP anchor, SEXP target, SEXP count, 
 		SEXP width, SEXP exclude, 
@@ -8,13 +82,16 @@ SEXP quadrant_bg (SEXP anchor, SEXP target, SEXP count,
 	if (!isInteger(anchor) || !isInteger(target)) { throw std::runtime_error("anchor/target vectors must be integer"); }
 	const int npair=LENGTH(anchor);
 	if (LENGTH(target)!=npair) { throw std::runtime_error("anchor/target vectors must have the same length"); }
-	if (!isInteger(count)) { throw std::runtime_error("vector of abundances should be integer"); }
-	if (LENGTH(count)!=npair) { throw std::runtime_error("vector of counts should be the same length as that of the indices"); }
+	if (!isInteger(count)) { throw std::runtime_error("matrix of abundances should be integer"); }
+	const int nlibs=ncols(count);
+	if (nrows(count)!=npair) { throw std::runtime_error("number of rows in the count matrix should be equal to the number of bin pairs"); }
   	
-	// Setting up pointers.
+	// Setting up pointers, and transposing the counts so that libraries are contiguous.
 	const int * aptr=INTEGER(anchor), 
-	  * tptr=INTEGER(target),
-      * cptr=INTEGER(count);
+	  * tptr=INTEGER(target);
+	std::vector<int> transposed;
+	to_contiguous(INTEGER(count), npair, nlibs, transposed);
+	const int* cptr=transposed.data();
 
 	// Determining the flank width.
 	if (!isInteger(width) || LENGTH(width)!=1) { throw std::runtime_error("flank width must be an integer scalar"); }
@@ -36,9 +113,8 @@ SEXP quadrant_bg (SEXP anchor, SEXP target, SEXP count,
         SEXP count_out=VECTOR_ELT(output, 0); 
         int** optrs=(int**)R_alloc(4, sizeof(int*));
         for (int i=0; i<4; ++i) {
-            SET_VECTOR_ELT(count_out, i, allocVector(INTSXP, npair));
+            SET_VECTOR_ELT(count_out, i, allocMatrix(INTSXP, npair, nlibs));
             optrs[i]=INTEGER(VECTOR_ELT(count_out, i));
-            std::fill(optrs[i], optrs[i]+npair, 0);
         }
 
         // Setting up output for the neighbourhood size.
@@ -51,61 +127,40 @@ SEXP quadrant_bg (SEXP anchor, SEXP target, SEXP count,
             std::fill(nptrs[i], nptrs[i]+npair, 0);
         }
 
-        int* optr=NULL, *nptr=NULL;
-		int curpair, running_sum,
-			left_index, right_index,
-			left_edge, right_edge, cur_anchor; 
-
 		// Iterating over all quadrants.
-		bottomright br(flank_width, tlength, intrachr, exwidth);		
-		updown ud(flank_width, tlength, intrachr, exwidth);
-		leftright lr(flank_width, tlength, intrachr, exwidth);
-		allaround aa(flank_width, tlength, intrachr, exwidth);
-		basic* current=NULL;
-
-		for (int quadtype=(intrachr ? 0 : 1); quadtype<4; ++quadtype) {
+		std::vector<int> collected(npair*nlibs);
+		for (int quadtype=0; quadtype<4; ++quadtype) {
+			std::fill(collected.begin(), collected.end(), 0);
+			int* nptr=nptrs[quadtype];
 			switch(quadtype) { 
-				case 0: current=&br; break;
-				case 1: current=&ud; break;
-				case 2: current=&lr; break;
-				case 3: current=&aa; break;
-			}
-            optr=optrs[quadtype];
-            nptr=nptrs[quadtype];
-
-			// Iterating across all flank widths.
-			do {
-				running_sum=0;
-				left_index=0;
-				right_index=0;
-				
-				for (curpair=0; curpair<npair; ++curpair) {
-					current->set(aptr[curpair], tptr[curpair]);
-					cur_anchor=current->row;
-					if (cur_anchor >= alength) { break; }
-					left_edge=current->left;
-					right_edge=current->right;
-
-					// Identifying all bin pairs in the relevant range.
-					while (left_index < npair && (aptr[left_index] < cur_anchor || 
-							(aptr[left_index]==cur_anchor && tptr[left_index] < left_edge))) {
-						running_sum -= cptr[left_index];
-						++left_index;
+				case 0: 
+					if (intrachr) {
+						bottomright br(flank_width, tlength, intrachr, exwidth);		
+						sweep_neighborhood(br, aptr, tptr, cptr, npair, nlibs, alength, collected.data(), nptr);
 					}
-
-					while (right_index < npair && (aptr[right_index]<cur_anchor || 
-							(aptr[right_index]==cur_anchor && tptr[right_index] < right_edge))) { 
-						running_sum += cptr[right_index];
-						++right_index;		
+					break;
+				case 1: 
+					{
+						updown ud(flank_width, tlength, intrachr, exwidth);
+						sweep_neighborhood(ud, aptr, tptr, cptr, npair, nlibs, alength, collected.data(), nptr);
+					}
+					break;
+				case 2: 
+					{
+						leftright lr(flank_width, tlength, intrachr, exwidth);
+						sweep_neighborhood(lr, aptr, tptr, cptr, npair, nlibs, alength, collected.data(), nptr);
+					}
+					break;
+				case 3: 
+					{
+						allaround aa(flank_width, tlength, intrachr, exwidth);
+						sweep_neighborhood(aa, aptr, tptr, cptr, npair, nlibs, alength, collected.data(), nptr);
 					}
+					break;
+			}
 
-                    // Adding them onto the current location (except if the anchor is negative;
-                    // skipping needs to be done here, as running_sum still needs to be calculated).
-                    if (cur_anchor <  0) { continue; }
-				    optr[curpair] += running_sum;
-                    nptr[curpair] += right_edge - left_edge;
-				}
-			} while (current->bump_level());
+			// Transposing the collected counts back into the output matrix.
+			from_contiguous(collected, npair, nlibs, optrs[quadtype]);
 		}
 	} catch (std::exception &e) {
 		UNPROTECT(1);
@@ -118,4 +173,109 @@ SEXP quadrant_bg (SEXP anchor, SEXP target, SEXP count,
 	return mkString(e.what());
 }
 
+/* This computes the counts for a user-defined neighbourhood, specified as a logical
+ * matrix that is used as a stencil around each bin pair (see the kernel class).
+ */
+
+SEXP kernel_bg (SEXP anchor, SEXP target, SEXP count, SEXP mask, 
+		SEXP alen, SEXP tlen, SEXP issame) try {
+
+	if (!isInteger(anchor) || !isInteger(target)) { throw std::runtime_error("anchor/target vectors must be integer"); }
+	const int npair=LENGTH(anchor);
+	if (LENGTH(target)!=npair) { throw std::runtime_error("anchor/target vectors must have the same length"); }
+	if (!isInteger(count)) { throw std::runtime_error("matrix of abundances should be integer"); }
+	const int nlibs=ncols(count);
+	if (nrows(count)!=npair) { throw std::runtime_error("number of rows in the count matrix should be equal to the number of bin pairs"); }
+	std::vector<int> transposed;
+	to_contiguous(INTEGER(count), npair, nlibs, transposed);
+
+	if (!isLogical(mask)) { throw std::runtime_error("kernel must be a logical matrix"); }
+	if (!isInteger(alen) || LENGTH(alen)!=1) { throw std::runtime_error("anchor length must be an integer scalar"); }
+	const int alength=asInteger(alen);
+	if (!isInteger(tlen) || LENGTH(tlen)!=1) { throw std::runtime_error("anchor length must be an integer scalar"); }
+	const int tlength=asInteger(tlen);
+	if (!isLogical(issame) || LENGTH(issame)!=1) { throw std::runtime_error("same chromosome specifier must be a logical scalar"); }
+	const bool intrachr=asLogical(issame);
+	kernel stencil(LOGICAL(mask), nrows(mask), ncols(mask), tlength, intrachr);
+
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+	try {
+		SET_VECTOR_ELT(output, 0, allocMatrix(INTSXP, npair, nlibs));
+		SET_VECTOR_ELT(output, 1, allocVector(INTSXP, npair));
+		int* nptr=INTEGER(VECTOR_ELT(output, 1));
+		std::fill(nptr, nptr+npair, 0);
+
+		std::vector<int> collected(npair*nlibs);
+		sweep_neighborhood(stencil, INTEGER(anchor), INTEGER(target), transposed.data(), npair, nlibs, alength, collected.data(), nptr);
+		from_contiguous(collected, npair, nlibs, INTEGER(VECTOR_ELT(output, 0)));
+	} catch (std::exception &e) {
+		UNPROTECT(1);
+		throw;
+	}
+	   
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+/* This computes the same statistics as quadrant_bg, but using the summed-area approach
+ * in summed_area.h. This is faster for large flanks, see .useSummedArea in enrichedPairs.R.
+ */
+
+SEXP quadrant_sat (SEXP anchor, SEXP target, SEXP count, 
+		SEXP width, SEXP exclude, 
+		SEXP alen, SEXP tlen, SEXP issame) try {
+
+	if (!isInteger(anchor) || !isInteger(target)) { throw std::runtime_error("anchor/target vectors must be integer"); }
+	const int npair=LENGTH(anchor);
+	if (LENGTH(target)!=npair) { throw std::runtime_error("anchor/target vectors must have the same length"); }
+	if (!isInteger(count)) { throw std::runtime_error("matrix of abundances should be integer"); }
+	const int nlibs=ncols(count);
+	if (nrows(count)!=npair) { throw std::runtime_error("number of rows in the count matrix should be equal to the number of bin pairs"); }
+
+	if (!isInteger(width) || LENGTH(width)!=1) { throw std::runtime_error("flank width must be an integer scalar"); }
+	const int flank_width=asInteger(width);
+	if (!isInteger(exclude) || LENGTH(exclude)!=1) { throw std::runtime_error("exclusion width must be an integer scalar"); }
+	const int exwidth=asInteger(exclude);
+
+	if (!isInteger(alen) || LENGTH(alen)!=1) { throw std::runtime_error("anchor length must be an integer scalar"); }
+	const int alength=asInteger(alen);
+	if (!isInteger(tlen) || LENGTH(tlen)!=1) { throw std::runtime_error("anchor length must be an integer scalar"); }
+	const int tlength=asInteger(tlen);
+	if (!isLogical(issame) || LENGTH(issame)!=1) { throw std::runtime_error("same chromosome specifier must be a logical scalar"); }
+	const bool intrachr=asLogical(issame);
+	summed_area engine(flank_width, exwidth, alength, tlength, intrachr);
+
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+	try {
+		const int nmodes=summed_area::nmodes;
+        SET_VECTOR_ELT(output, 0, allocVector(VECSXP, nmodes));
+        SEXP count_out=VECTOR_ELT(output, 0); 
+        int** optrs=(int**)R_alloc(nmodes, sizeof(int*));
+        SET_VECTOR_ELT(output, 1, allocVector(VECSXP, nmodes));
+        SEXP n_out=VECTOR_ELT(output, 1); 
+        int** nptrs=(int**)R_alloc(nmodes, sizeof(int*));
 
+        for (int i=0; i<nmodes; ++i) {
+            SET_VECTOR_ELT(count_out, i, allocMatrix(INTSXP, npair, nlibs));
+            optrs[i]=INTEGER(VECTOR_ELT(count_out, i));
+            std::fill(optrs[i], optrs[i]+npair*nlibs, 0);
+            SET_VECTOR_ELT(n_out, i, allocVector(INTSXP, npair));
+            nptrs[i]=INTEGER(VECTOR_ELT(n_out, i));
+            std::fill(nptrs[i], nptrs[i]+npair, 0);
+        }
+
+        std::vector<int> transposed;
+        to_contiguous(INTEGER(count), npair, nlibs, transposed);
+        engine.compute(INTEGER(anchor), INTEGER(target), transposed.data(), npair, nlibs, NULL, npair, optrs, nptrs);
+	} catch (std::exception &e) {
+		UNPROTECT(1);
+		throw;
+	}
+	   
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
@@ -28,8 +28,8 @@ public:
 	int get_nbins() const;
 	int get_anchor() const;
 
-    const std::deque<int>& get_counts() const;
-    const std::deque<int>& get_changed() const;
+    const std::vector<int>& get_counts() const;
+    const std::vector<int>& get_changed() const;
 private:
 	const int fbin, lbin, nbins;
 	const int* bptr;
@@ -39,13 +39,16 @@ private:
 	std::deque<int> nums, indices;
     pair_queue next;
 	
-	int curab, curtb, curlib, curdex, lib;
-	bool failed;
+	int curab, curtb, curlib;
+
+    // Buffers for sparse and dense accumulation of counts in each row.
+    static const size_t sparse_ratio;
+    std::vector<int> buffer, dense;
+    std::vector<bool> ischanged;
 
     // Stuff that is visible to the calling class.
-    std::deque<int> curcounts;
-    std::deque<bool> ischanged;
-    std::deque<int> waschanged;
+    std::vector<int> curcounts;
+    std::vector<int> waschanged;
 };
 
 #endif
@@ -0,0 +1,183 @@
+#include "summed_area.h"
+
+summed_area::rectangle::rectangle(int m, int rl, int rh, int cl, int ch) : mode(m), rowlo(rl), rowhi(rh), collo(cl), colhi(ch) {}
+
+/* Rectangles are defined relative to the bin pair of interest, with rows from 'rowlo' to
+ * 'rowhi' (inclusive) and columns from 'collo' to 'colhi' (exclusive). These match the
+ * boundaries reported by set() at each level in neighbors.cpp.
+ */
+
+summed_area::summed_area(int w, int x, int a, int t, bool i) : width(w), exclude(x), alen(a), tlen(t), intra(i) {
+	if (width < 0 || exclude < 0) { throw std::runtime_error("width values must be non-negative"); }
+	if (exclude >= width) { throw std::runtime_error("exclusion width must be less than flank width"); }
+
+	if (intra) { // bottomright
+		rectangles.push_back(rectangle(0, -width, -exclude-1, 0, width+1));
+		rectangles.push_back(rectangle(0, -exclude, 0, exclude+1, width+1));
+	}
+
+	// updown
+	rectangles.push_back(rectangle(1, -width, -exclude-1, 0, 1));
+	rectangles.push_back(rectangle(1, exclude+1, width, 0, 1));
+
+	// leftright
+	rectangles.push_back(rectangle(2, 0, 0, -width, -exclude));
+	rectangles.push_back(rectangle(2, 0, 0, exclude+1, width+1));
+
+	// allaround
+	rectangles.push_back(rectangle(3, -width, -exclude-1, -width, width+1));
+	rectangles.push_back(rectangle(3, exclude+1, width, -width, width+1));
+	rectangles.push_back(rectangle(3, -exclude, exclude, -width, -exclude));
+	rectangles.push_back(rectangle(3, -exclude, exclude, exclude+1, width+1));
+	return;
+}
+
+/* Computing the area of a rectangle (rows from r0 to r1 inclusive, columns from L to R exclusive) 
+ * after restricting it to the interaction space. Rows must lie in [0, alen), and columns must
+ * lie in [0, tlen) or, for intra-chromosomal interactions, below the diagonal (i.e., [0, row+1)).
+ * The latter is handled with an arithmetic series for the rows that intersect the diagonal.
+ */
+
+int summed_area::clipped_area(int r0, int r1, int L, int R) const {
+	if (r0 < 0) { r0=0; }
+	if (r1 >= alen) { r1=alen-1; }
+	if (L < 0) { L=0; }
+	if (r0 > r1) { return 0; }
+
+	if (!intra) {
+		if (R > tlen) { R=tlen; }
+		return (R > L ? (R-L)*(r1-r0+1) : 0);
+	}
+
+	if (R <= L) { return 0; }
+	int total=0;
+	int lo=std::max(r0, L), hi=std::min(r1, R-2); // rows where the diagonal cuts the rectangle, i.e., width of r+1-L.
+	if (lo <= hi) { total+=(hi-lo+1)*(lo+hi+2-2*L)/2; }
+	lo=std::max(r0, R-1); // rows where the diagonal is past the rectangle, i.e., width of R-L.
+	if (lo <= r1) { total+=(r1-lo+1)*(R-L); }
+	return total;
+}
+
+void summed_area::compute(const int* aptr, const int* tptr, const int* cptr, int npair, int nlibs, 
+		const int* outdex, int nout, int** count_out, int** area_out) const {
+	std::vector<int> identity;
+	if (outdex==NULL) {
+		identity.resize(npair);
+		for (int i=0; i<npair; ++i) { identity[i]=i; }
+		outdex=identity.data();
+		nout=npair;
+	}
+
+	// Computing the areas.
+	for (size_t r=0; r<rectangles.size(); ++r) {
+		const rectangle& current=rectangles[r];
+		int* curarea=area_out[current.mode];
+		for (int i=0; i<npair; ++i) {
+			if (outdex[i] < 0) { continue; }
+			curarea[outdex[i]]+=clipped_area(aptr[i]+current.rowlo, aptr[i]+current.rowhi, tptr[i]+current.collo, tptr[i]+current.colhi);
+		}
+	}
+
+	/* Identifying the unique row and column offsets for the corners of the rectangles. 
+	 * Each rectangle has corners at rows 'rowlo-1' and 'rowhi', and at columns 'collo' and 'colhi'.
+	 * The prefix sum at each corner is multiplied by a coefficient of +/-1 for each mode.
+	 */
+	std::vector<int> row_offsets, col_offsets;
+	for (size_t r=0; r<rectangles.size(); ++r) {
+		const rectangle& current=rectangles[r];
+		row_offsets.push_back(current.rowlo-1);
+		row_offsets.push_back(current.rowhi);
+		col_offsets.push_back(current.collo);
+		col_offsets.push_back(current.colhi);
+	}
+	std::sort(row_offsets.begin(), row_offsets.end());
+	row_offsets.erase(std::unique(row_offsets.begin(), row_offsets.end()), row_offsets.end());
+	std::sort(col_offsets.begin(), col_offsets.end());
+	col_offsets.erase(std::unique(col_offsets.begin(), col_offsets.end()), col_offsets.end());
+	const int nrows=row_offsets.size(), ncols=col_offsets.size();
+
+	std::vector<int> coefficients(nrows*ncols*nmodes);
+	for (size_t r=0; r<rectangles.size(); ++r) {
+		const rectangle& current=rectangles[r];
+		const int lo_row=std::lower_bound(row_offsets.begin(), row_offsets.end(), current.rowlo-1) - row_offsets.begin();
+		const int hi_row=std::lower_bound(row_offsets.begin(), row_offsets.end(), current.rowhi) - row_offsets.begin();
+		const int lo_col=std::lower_bound(col_offsets.begin(), col_offsets.end(), current.collo) - col_offsets.begin();
+		const int hi_col=std::lower_bound(col_offsets.begin(), col_offsets.end(), current.colhi) - col_offsets.begin();
+		coefficients[(hi_row*ncols + hi_col)*nmodes + current.mode]+=1;
+		coefficients[(hi_row*ncols + lo_col)*nmodes + current.mode]-=1;
+		coefficients[(lo_row*ncols + hi_col)*nmodes + current.mode]-=1;
+		coefficients[(lo_row*ncols + lo_col)*nmodes + current.mode]+=1;
+	}
+
+	// Compressing the target indices, for use in the Fenwick tree.
+	std::vector<int> unique_targets(tptr, tptr+npair);
+	std::sort(unique_targets.begin(), unique_targets.end());
+	unique_targets.erase(std::unique(unique_targets.begin(), unique_targets.end()), unique_targets.end());
+	const int ntargets=unique_targets.size();
+	std::vector<int> tree(ntargets*nlibs), prefix(nlibs);
+
+	/* Sweeping through the rows. Queries for each row offset are sorted by row, as bin pairs are
+	 * sorted by anchor; so we can just keep a pointer to the next query for each offset. All bin 
+	 * pairs with anchors at or below the query row are added to the tree before the query is answered.
+	 */
+	std::vector<int> next_query(nrows);
+	int next_entry=0;
+	while (1) {
+		int current_row=0;
+		bool found=false;
+		for (int r=0; r<nrows; ++r) { 
+			if (next_query[r] < npair) {
+				const int candidate=aptr[next_query[r]]+row_offsets[r];
+				if (!found || candidate < current_row) { 
+					current_row=candidate;
+					found=true;
+				}
+			}
+		}
+		if (!found) { break; }
+
+		while (next_entry < npair && aptr[next_entry] <= current_row) {
+			const int position=std::lower_bound(unique_targets.begin(), unique_targets.end(), tptr[next_entry]) - unique_targets.begin();
+			for (int k=position+1; k<=ntargets; k+=(k & -k)) {
+				int* curtree=tree.data() + (k-1)*nlibs;
+				const int* curcounts=cptr + next_entry*nlibs;
+				for (int lib=0; lib<nlibs; ++lib) { curtree[lib]+=curcounts[lib]; }
+			}
+			++next_entry;
+		}
+
+		for (int r=0; r<nrows; ++r) { 
+			int& curq=next_query[r];
+			while (curq < npair && aptr[curq]+row_offsets[r]==current_row) {
+				if (outdex[curq] < 0) { 
+					++curq;
+					continue;
+				}
+				for (int c=0; c<ncols; ++c) { 
+					const int* curcoef=coefficients.data() + (r*ncols + c)*nmodes;
+					bool nonzero=false;
+					for (int m=0; m<nmodes; ++m) { 
+						if (curcoef[m]) { nonzero=true; }
+					}
+					if (!nonzero) { continue; }
+
+					// Prefix sum for all bin pairs at or below the current row, with targets below the column boundary.
+					const int column=tptr[curq]+col_offsets[c];
+					std::fill(prefix.begin(), prefix.end(), 0);
+					for (int k=std::lower_bound(unique_targets.begin(), unique_targets.end(), column) - unique_targets.begin(); k>0; k-=(k & -k)) {
+						const int* curtree=tree.data() + (k-1)*nlibs;
+						for (int lib=0; lib<nlibs; ++lib) { prefix[lib]+=curtree[lib]; }
+					}
+
+					for (int m=0; m<nmodes; ++m) {
+						if (!curcoef[m]) { continue; }
+						int* curout=count_out[m] + outdex[curq];
+						for (int lib=0; lib<nlibs; ++lib) { curout[lib*nout]+=curcoef[m]*prefix[lib]; }
+					}
+				}
+				++curq;
+			}
+		}
+	}
+	return;
+}
@@ -0,0 +1,45 @@
+#ifndef SUMMED_AREA_H
+#define SUMMED_AREA_H
+
+#include "diffhic.h"
+
+/* This class computes the neighbourhood counts for all bin pairs in a chromosome pair, 
+ * using a summed-area (i.e., 2D prefix sum) approach. Each neighbourhood is decomposed 
+ * into rectangles, and the count in each rectangle is computed from the prefix sums at 
+ * its corners. Prefix sums are obtained by sweeping through the rows of the interaction 
+ * space in order, with a Fenwick tree over the (compressed) target bins. This means that 
+ * the cost per bin pair is independent of the flank width, unlike the methods in neighbors.h.
+ *
+ * Neighbourhoods are defined in the same order as in neighbors.h, i.e., bottomright, 
+ * updown, leftright and allaround. The bottomright neighbourhood is only computed for
+ * intra-chromosomal interactions.
+ */
+
+class summed_area {
+public:
+	summed_area(int, int, int, int, bool);
+
+	/* Bin pairs should be sorted by anchor and target indices. Counts should be stored
+	 * such that the values for all libraries of each bin pair are contiguous. Each bin 
+	 * pair is reported in the row of the output specified by 'outdex', or skipped if its
+	 * value is negative (NULL reports all bin pairs in their input order). Neighbourhood 
+	 * counts are added to 'count_out' (one pointer per mode, each to a column-major 
+	 * 'nout*nlibs' matrix) while neighbourhood areas are added to 'area_out' (one pointer
+	 * per mode, each to a vector of length 'nout').
+	 */
+	void compute(const int*, const int*, const int*, int, int, const int*, int, int**, int**) const;
+
+	static const int nmodes=4;
+private:
+	int width, exclude, alen, tlen;
+	bool intra;
+
+	struct rectangle { 
+		rectangle(int, int, int, int, int);
+		int mode, rowlo, rowhi, collo, colhi;
+	};
+	std::vector<rectangle> rectangles;
+	int clipped_area(int, int, int, int) const;
+};
+
+#endif
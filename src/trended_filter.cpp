@@ -1,53 +1,226 @@
 #include "diffhic.h"
 
+/* This summarizes the distances between the midpoints of the bins for all empty bin pairs
+ * in the intra-chromosomal interaction space. If 'step' is zero, exact distances are reported;
+ * this requires the midpoints on each chromosome to be equally spaced, except for the last bin 
+ * (which may be truncated at the chromosome end), such that there are at most two distinct 
+ * distances per bin. The number of bin pairs at each distance is then obtained directly, without 
+ * considering each bin pair. Otherwise, distances are rounded onto a grid of log10(distance + prior) 
+ * with spacing 'step', where the first grid point corresponds to a distance of zero. For each anchor 
+ * bin, the number of target bins in each grid cell is counted by advancing one pointer per cell along 
+ * the sorted midpoints of the chromosome. In both cases, the existing bin pairs are then subtracted. 
+ * This returns each distance (in increasing order) and the number of empty bin pairs at that distance,
+ * such that memory usage is proportional to the number of distinct distances or grid points.
+ */
+
 extern "C" {
 
-SEXP get_missing_dist (SEXP chrends, SEXP existing_anchor, SEXP existing_target, SEXP middies) try {
+SEXP get_missing_dist (SEXP chrends, SEXP existing_anchor, SEXP existing_target, SEXP middies, SEXP prior, SEXP step) try {
 	if (!isInteger(chrends)) { throw std::runtime_error("chromosome end indices must be integer"); }
 	const int nchrs = LENGTH(chrends);
 	if (!isInteger(existing_anchor)) { throw std::runtime_error("anchor indices must be integer"); }
 	if (!isInteger(existing_target)) { throw std::runtime_error("target indices must be integer"); }
 	const int npts = LENGTH(existing_anchor);
 	if (npts!=LENGTH(existing_target)) { throw std::runtime_error("anchor and target index vectors must be of the same length"); }
-	if (!isNumeric(middies)) { throw std::runtime_error("midpoint vector must be double-precision"); }
+	if (!isReal(middies)) { throw std::runtime_error("midpoint vector must be double-precision"); }
+	if (!isReal(prior) || LENGTH(prior)!=1 || !(asReal(prior) > 0) || !R_FINITE(asReal(prior))) { throw std::runtime_error("distance prior must be a positive double-precision scalar"); }
+	if (!isReal(step) || LENGTH(step)!=1 || !(asReal(step) >= 0) || !R_FINITE(asReal(step))) { throw std::runtime_error("grid step must be a non-negative double-precision scalar"); }
+	const double pr=asReal(prior), st=asReal(step);
+	const bool exact=(st==0);
 
 	const int* cptr=INTEGER(chrends);
 	const int* aptr=INTEGER(existing_anchor);
 	const int* tptr=INTEGER(existing_target);
 	const double* mptr=REAL(middies);
-	
-	std::deque<double> stored;
-	int chr_start=0, chr_index=0, pt_index=0;
-	int anchor=0, target=0;
-	bool ispresent;
+	const int nbins=LENGTH(middies);
+
+	// Defining the upper distance boundary of each grid cell, up to the largest span on any chromosome.
+	double maxspan=0;
+	{
+		int chr_start=0;
+		for (int chr_index=0; chr_index<nchrs; ++chr_index) {
+			const int& chr_end=cptr[chr_index];
+			if (chr_end < chr_start || chr_end > nbins) { throw std::runtime_error("invalid chromosome end indices"); }
+			if (chr_end > chr_start) {
+				const double* first=mptr+chr_start, * last=mptr+chr_end;
+				maxspan=std::max(maxspan, *std::max_element(first, last) - *std::min_element(first, last));
+			}
+			chr_start=chr_end;
+		}
+		if (!R_FINITE(maxspan)) { throw std::runtime_error("midpoints must be finite"); }
+	}
+	const double lowest=std::log10(pr);
+	std::vector<double> upper;
+	if (!exact) {
+		do {
+			upper.push_back(std::pow(10, lowest + (upper.size() + 0.5)*st) - pr);
+		} while (upper.back() <= maxspan);
+	}
+	const int ncells=upper.size();
 
-	while (chr_index < nchrs) {
+	std::vector<double> collected(ncells), sorted;
+	std::vector<int> pointers(ncells);
+	std::map<double, double> by_distance;
+	int chr_start=0, pt_index=0;
+
+	for (int chr_index=0; chr_index<nchrs; ++chr_index) {
  	   	const int& chr_end=cptr[chr_index];
-		
-		for (anchor=chr_start; anchor<chr_end; ++anchor) {
-			for (target=chr_start; target<=anchor; ++target) {
-				ispresent=false;
- 			   	while (pt_index < npts && aptr[pt_index]==anchor && tptr[pt_index]==target) { 
-					ispresent=true;
-					++pt_index; 
+		const int nchr=chr_end-chr_start;
+		sorted.assign(mptr+chr_start, mptr+chr_end);
+		std::sort(sorted.begin(), sorted.end());
+
+		if (exact) {
+			/* Counting all bin pairs on this chromosome at each multiple of the spacing. The last bin
+			 * is handled separately if it breaks the spacing, by adding its distance to every bin.
+			 */
+			int nregular=nchr;
+			for (int b=2; b<nchr; ++b) {
+				if (sorted[b]-sorted[b-1]!=sorted[1]-sorted[0]) { 
+					if (b!=nchr-1) { throw std::runtime_error("midpoints must be equally spaced for exact distances"); }
+					nregular=b;
+				}
+			}
+			for (int k=0; k<nregular; ++k) { by_distance[sorted[k]-sorted[0]]+=nregular-k; }
+			if (nregular < nchr) { 
+				for (int b=0; b<nchr; ++b) { by_distance[sorted[nchr-1]-sorted[b]]+=1; }
+			}
+		} else {
+			/* Counting all bin pairs on this chromosome. The set of pairwise distances is not affected by sorting,
+			 * and each pointer only moves forward as the anchor increases, as distances to earlier targets only increase.
+			 */
+			std::fill(pointers.begin(), pointers.end(), 0);
+			for (int anchor=0; anchor<nchr; ++anchor) {
+				const double& curmid=sorted[anchor];
+				int previous=anchor+1;
+				for (int cell=0; cell<ncells && previous > 0; ++cell) {
+					int& current=pointers[cell];
+					while (curmid - sorted[current] >= upper[cell]) { ++current; }
+					collected[cell]+=previous - current;
+					previous=current;
 				}
-				if (!ispresent) { stored.push_back(mptr[anchor]-mptr[target]); }
 			}
 		}
 
+		// Subtracting the existing bin pairs on this chromosome, which should be sorted by anchor and then target.
+		int preva=-1, prevt=-1;
+		while (pt_index < npts && aptr[pt_index] < chr_end) {
+			const int& cura=aptr[pt_index];
+			const int& curt=tptr[pt_index];
+			if (curt < chr_start || curt > cura || cura < preva || (cura==preva && curt < prevt)) { break; }
+			if (cura!=preva || curt!=prevt) {
+				const double curdist=std::abs(mptr[cura]-mptr[curt]);
+				if (exact) {
+					--by_distance[curdist];
+				} else {
+					--collected[std::upper_bound(upper.begin(), upper.end(), curdist) - upper.begin()];
+				}
+			}
+			preva=cura;
+			prevt=curt;
+			++pt_index;
+		}
+
 		chr_start=chr_end;
-		++chr_index;
 	}
 	if (pt_index!=npts) { throw std::runtime_error("failed to parse all supplied points"); }
 
-	SEXP output=PROTECT(allocVector(REALSXP, stored.size()));
-try{
-	double * optr=REAL(output);
-	for (size_t o=0; o<stored.size(); ++o) { optr[o]=stored[o]; }
-} catch (std::exception& e) { 
+	// Converting grid cells into distances.
+	std::deque<std::pair<double, double> > nonempty;
+	if (exact) {
+		for (std::map<double, double>::const_iterator bdIt=by_distance.begin(); bdIt!=by_distance.end(); ++bdIt) {
+			if (bdIt->second > 0) { nonempty.push_back(*bdIt); }
+		}
+	} else {
+		for (int cell=0; cell<ncells; ++cell) {
+			if (collected[cell] <= 0) { continue; }
+			nonempty.push_back(std::make_pair(cell ? std::pow(10, lowest + cell*st) - pr : 0, collected[cell]));
+		}
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 2));
+try {
+	const int ndist=nonempty.size();
+	SET_VECTOR_ELT(output, 0, allocVector(REALSXP, ndist));
+	double* dptr=REAL(VECTOR_ELT(output, 0));
+	SET_VECTOR_ELT(output, 1, allocVector(REALSXP, ndist));
+	double* nptr=REAL(VECTOR_ELT(output, 1));
+	for (int d=0; d<ndist; ++d) {
+		dptr[d]=nonempty[d].first;
+		nptr[d]=nonempty[d].second;
+	}
+} catch (std::exception& e) {
 	UNPROTECT(1);
 	throw;
-} 
+}
+	UNPROTECT(1);
+	return output;
+} catch (std::exception& e) {
+	return mkString(e.what());
+}
+
+
+/* This summarizes points for fitting a trend of 'y' against 'x'. Points are sorted by 'x'
+ * and grouped into 'nbins' bins containing roughly equal numbers of distinct 'x' values, 
+ * where tied 'x' values are never split across bins. The weights are not used for binning,
+ * as heavily weighted points (e.g., summaries of many empty bin pairs) would otherwise 
+ * absorb most of the bins. The weighted means of 'x' and 'y' and the total weight are
+ * returned for each bin, such that a curve can be fitted to the summaries rather than 
+ * to all points. Points with non-finite values or non-positive weights are ignored.
+ */
+
+SEXP bin_trend_points (SEXP x, SEXP y, SEXP weights, SEXP nbins) try {
+	if (!isReal(x) || !isReal(y) || !isReal(weights)) { throw std::runtime_error("covariate, response and weight vectors must be double-precision"); }
+	const int npts=LENGTH(x);
+	if (LENGTH(y)!=npts || LENGTH(weights)!=npts) { throw std::runtime_error("covariate, response and weight vectors must be of the same length"); }
+	if (!isInteger(nbins) || LENGTH(nbins)!=1 || asInteger(nbins) < 1) { throw std::runtime_error("number of bins must be a positive integer scalar"); }
+	const int nb=asInteger(nbins);
+	const double* xptr=REAL(x), * yptr=REAL(y), * wptr=REAL(weights);
+
+	std::vector<int> ordering;
+	ordering.reserve(npts);
+	for (int i=0; i<npts; ++i) {
+		if (!R_FINITE(xptr[i]) || !R_FINITE(yptr[i]) || !R_FINITE(wptr[i]) || wptr[i] <= 0) { continue; }
+		ordering.push_back(i);
+	}
+	std::sort(ordering.begin(), ordering.end(), sort_row_index<double>(xptr));
+	const int nkept=ordering.size();
+	double ndistinct=0;
+	for (int k=0; k<nkept; ++k) {
+		if (k+1==nkept || xptr[ordering[k+1]]!=xptr[ordering[k]]) { ++ndistinct; }
+	}
+
+	// Closing each bin once the number of distinct covariates passes the next quantile.
+	std::deque<double> sumx, sumy, sumw;
+	double curx=0, cury=0, curw=0, ndone=0, nclosed=0;
+	for (int k=0; k<nkept; ++k) {
+		const int& i=ordering[k];
+		curx+=xptr[i]*wptr[i];
+		cury+=yptr[i]*wptr[i];
+		curw+=wptr[i];
+		if (k+1 < nkept && xptr[ordering[k+1]]==xptr[i]) { continue; }
+		++ndone;
+		if (k+1==nkept || ndone*nb >= ndistinct*(nclosed+1)) {
+			sumx.push_back(curx/curw);
+			sumy.push_back(cury/curw);
+			sumw.push_back(curw);
+			curx=cury=curw=0;
+			nclosed=std::floor(ndone*nb/ndistinct);
+		}
+	}
+
+	SEXP output=PROTECT(allocVector(VECSXP, 3));
+try {
+	const int nsummaries=sumw.size();
+	SET_VECTOR_ELT(output, 0, allocVector(REALSXP, nsummaries));
+	std::copy(sumx.begin(), sumx.end(), REAL(VECTOR_ELT(output, 0)));
+	SET_VECTOR_ELT(output, 1, allocVector(REALSXP, nsummaries));
+	std::copy(sumy.begin(), sumy.end(), REAL(VECTOR_ELT(output, 1)));
+	SET_VECTOR_ELT(output, 2, allocVector(REALSXP, nsummaries));
+	std::copy(sumw.begin(), sumw.end(), REAL(VECTOR_ELT(output, 2)));
+} catch (std::exception& e) {
+	UNPROTECT(1);
+	throw;
+}
 	UNPROTECT(1);
 	return output;
 } catch (std::exception& e) {